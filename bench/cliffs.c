@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAX_STEPS 16
+#define MAX_ARGS 16
+#define MIN_MILLIS 0.01
+
+/**
+ * A worst case trace generator, parametrized by the input size n: a load phase building a history of size n,
+ * then n expensive operations on it. Only the operations are timed (the load phase alone is timed and
+ * subtracted), so operations costing O(n) each show up as a slope near 2.
+ */
+typedef struct cliff_s {
+    const char *name;
+    const char *description;
+    void (*load)(FILE *out, int n);
+    void (*operations)(FILE *out, int n);
+    double max_slope;
+}cliff_t;
+
+/**
+ * A document of n lines.
+ */
+void load_document(FILE *out, int n) {
+    fprintf(out, "1,%dc\n", n);
+    for(int i = 0; i < n; i++) fprintf(out, "line %d\n", i);
+    fputs(".\n", out);
+}
+
+/**
+ * n/2 alternating 1,1d: every delete shifts and snapshots the whole document.
+ */
+void operations_delete_front(FILE *out, int n) {
+    for(int i = 0; i < n / 2; i++) fputs("1,1d\n1,1p\n", out);
+}
+
+/**
+ * n single line changes.
+ */
+void load_changes(FILE *out, int n) {
+    for(int i = 1; i <= n; i++) fprintf(out, "%d,%dc\nchange %d\n.\n", i, i, i);
+}
+
+/**
+ * n undos and redos at least n/2 deep: every jump replays the changes since the last snapshot.
+ */
+void operations_deep_undo(FILE *out, int n) {
+    for(int i = 0; i < n; i++) {
+        fprintf(out, "%du\n1,2p\n%dr\n1,2p\n", n / 2 + i % (n / 2), n / 2 + i % (n / 2));
+    }
+}
+
+/**
+ * n snapshots (deletes) interleaved with changes.
+ */
+void load_snapshots(FILE *out, int n) {
+    for(int i = 0; i < n; i++) fprintf(out, "1,1c\nversion %d\n.\n2,2d\n", i);
+}
+
+/**
+ * n u/r ping-pongs across the snapshots: every jump searches the snapshot to restore.
+ */
+void operations_snapshot_pingpong(FILE *out, int n) {
+    for(int i = 0; i < n; i++) {
+        int depth = 1 + (int) ((i * 2654435761u) % (unsigned int) (2 * n - 1));
+        fprintf(out, "%du\n1,1p\n%dr\n1,1p\n", depth, depth);
+    }
+}
+
+/**
+ * n rounds of an undo and a change: every change makes the undo permanent, cutting the history off
+ * after n changes.
+ */
+void operations_change_after_undo(FILE *out, int n) {
+    for(int i = 0; i < n; i++) fprintf(out, "1u\n1,1c\nafter undo %d\n.\n", i);
+    fputs("1,1p\n", out);
+}
+
+/**
+ * Runs the editor on a trace and measures its wall time.
+ * @param argv the command line of the editor (not null)
+ * @param trace file descriptor of the trace
+ * @return the time in milliseconds, a negative number if the editor failed
+ */
+double run_trace(char **argv, int trace) {
+    struct timespec start, end;
+    int status;
+    lseek(trace, 0, SEEK_SET);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if(pid == 0) {
+        int out = open("/dev/null", O_WRONLY);
+        dup2(trace, 0);
+        dup2(out, 1);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    waitpid(pid, &status, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+    return (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+/**
+ * @param argv the command line of the editor (not null)
+ * @param trace file descriptor of the trace
+ * @param repeats
+ * @return the best time of the editor on the trace in milliseconds, a negative number if the editor failed
+ */
+double best_time(char **argv, int trace, int repeats) {
+    double best = -1;
+    for(int r = 0; r < repeats; r++) {
+        double t = run_trace(argv, trace);
+        if(t < 0) return -1;
+        if(best < 0 || t < best) best = t;
+    }
+    return best;
+}
+
+/**
+ * Least squares slope of log(time) against log(size).
+ * @param sizes (not null)
+ * @param millis (not null)
+ * @param count
+ * @return
+ */
+double log_log_slope(const int *sizes, const double *millis, int count) {
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for(int i = 0; i < count; i++) {
+        double x = log((double) sizes[i]), y = log(millis[i]);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    return (count * sxy - sx * sy) / (count * sxx - sx * sx);
+}
+
+void usage() {
+    fputs("usage: edu_cliffs [-n base_size] [-s steps] [-r repeats] [-c cliff] [-w] editor [editor args...]\n"
+          "Generates the worst case trace of every known complexity cliff at sizes base_size * 2^i: a history\n"
+          "of size n, then n expensive operations on it. Times the operations (the trace minus its load phase)\n"
+          "and fits a slope on the log-log plot. Fails if a slope exceeds the bound of its cliff, unless -w\n"
+          "(only report the slopes).\n", stderr);
+}
+
+int main(int argc, char *argv[]) {
+    cliff_t cliffs[] = {
+            {"delete_front", "1,1d on a large document", load_document, operations_delete_front, 1.7},
+            {"deep_undo", "deep u/r after many c", load_changes, operations_deep_undo, 1.7},
+            {"snapshot_pingpong", "u/r ping-pong across many snapshots", load_snapshots, operations_snapshot_pingpong, 1.7},
+            {"change_after_undo", "c after an undo on a long history", load_changes, operations_change_after_undo, 1.7},
+    };
+    int cliff_count = sizeof(cliffs) / sizeof(cliffs[0]);
+    int base = 2000, steps = 5, repeats = 3;
+    const char *only = NULL;
+    bool report_only = false;
+    char *editor[MAX_ARGS];
+    int sizes[MAX_STEPS];
+    double millis[MAX_STEPS];
+    int failed = 0;
+    int i = 1;
+
+    for(; i < argc && argv[i][0] == '-'; i++) {
+        if(strcmp(argv[i], "-w") == 0) {
+            report_only = true;
+            continue;
+        }
+        if(i + 1 >= argc) break;
+        if(strcmp(argv[i], "-n") == 0) base = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-s") == 0) steps = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-r") == 0) repeats = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-c") == 0) only = argv[++i];
+    }
+    if(i >= argc || argc - i >= MAX_ARGS || steps < 2 || steps > MAX_STEPS || base < 1 || repeats < 1) {
+        usage();
+        return 2;
+    }
+    for(int a = 0; i + a < argc; a++) editor[a] = argv[i + a];
+    editor[argc - i] = NULL;
+
+    printf("%-20s %10s %12s %12s %12s\n", "cliff", "size", "bytes", "load(ms)", "ops(ms)");
+    for(int c = 0; c < cliff_count; c++) {
+        if(only != NULL && strcmp(only, cliffs[c].name) != 0) continue;
+        for(int s = 0; s < steps; s++) {
+            FILE *load = tmpfile(), *trace = tmpfile();
+            sizes[s] = base << s;
+            cliffs[c].load(load, sizes[s]);
+            cliffs[c].load(trace, sizes[s]);
+            cliffs[c].operations(trace, sizes[s]);
+            fputs("q\n", load);
+            fputs("q\n", trace);
+            fflush(load);
+            fflush(trace);
+            double load_millis = best_time(editor, fileno(load), repeats);
+            millis[s] = best_time(editor, fileno(trace), repeats);
+            if(load_millis < 0) millis[s] = -1;
+            // the operations cannot take less than nothing: noise on a cheap phase
+            if(millis[s] >= 0) millis[s] = millis[s] - load_millis > MIN_MILLIS ? millis[s] - load_millis : MIN_MILLIS;
+            printf("%-20s %10d %12ld %12.2f %12.2f\n", cliffs[c].name, sizes[s], ftell(trace), load_millis, millis[s]);
+            fclose(load);
+            fclose(trace);
+            if(millis[s] < 0) break;
+        }
+        if(millis[steps - 1] < 0) {
+            printf("%-20s FAILED: the editor did not run to completion\n", cliffs[c].name);
+            failed++;
+            continue;
+        }
+        double slope = log_log_slope(sizes, millis, steps);
+        bool ok = slope <= cliffs[c].max_slope;
+        printf("%-20s slope %.2f (bound %.2f) %s -- %s\n", cliffs[c].name, slope, cliffs[c].max_slope,
+               ok ? "ok" : "FAILED", cliffs[c].description);
+        if(!ok) failed++;
+    }
+    return failed > 0 && !report_only ? 1 : 0;
+}
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAX_BINARIES 16
+#define INIT_CASES_LEN 64
+#define READ_BLOCK 65536
+
+/**
+ * A corpus case: the input file and the expected output, kept in memory.
+ */
+typedef struct case_s {
+    char *input;
+    char *expected;
+    size_t expected_len;
+}case_t;
+
+typedef struct corpus_s {
+    int size;
+    int capacity;
+    case_t *cases;
+}corpus_t;
+
+typedef struct binary_s {
+    char *name;
+    char *path;
+    int failed;
+    // corpus time of each repeat
+    double *totals;
+    double quickest;
+    double slowest;
+}binary_t;
+
+/**
+ * Reads a whole file.
+ * @param path (not null)
+ * @param len where to put the length (not null)
+ * @return the content, NULL if the file cannot be read
+ */
+char *read_file(const char *path, size_t *len) {
+    FILE *file = fopen(path, "rb");
+    if(file == NULL) return NULL;
+    fseek(file, 0, SEEK_END);
+    *len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *content = (char *) malloc(*len + 1);
+    if(fread(content, 1, *len, file) != *len) {
+        free(content);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    return content;
+}
+
+/**
+ * Adds a case if the expected output exists.
+ * @param corpus (not null)
+ * @param input path of the input (not null)
+ * @param expected path of the expected output (not null)
+ */
+void add_case(corpus_t *corpus, const char *input, const char *expected) {
+    case_t item;
+    item.expected = read_file(expected, &item.expected_len);
+    if(item.expected == NULL) return;
+    item.input = strdup(input);
+    if(corpus->size >= corpus->capacity) {
+        corpus->cases = (case_t *) realloc(corpus->cases, (corpus->size + INIT_CASES_LEN) * sizeof(case_t));
+        corpus->capacity = corpus->size + INIT_CASES_LEN;
+    }
+    corpus->cases[corpus->size] = item;
+    corpus->size++;
+}
+
+/**
+ * Collects the cases of a directory, in both layouts of the repository:
+ *      * casi_test: testN.txt / solN.txt
+ *      * publicTests: NAME_input.txt / NAME_output.txt
+ * @param corpus (not null)
+ * @param dir_path (not null)
+ */
+void load_dir(corpus_t *corpus, const char *dir_path) {
+    char input[4096], expected[4096];
+    struct dirent *entry;
+    DIR *dir = opendir(dir_path);
+    if(dir == NULL) {
+        fprintf(stderr, "cannot open %s\n", dir_path);
+        return;
+    }
+    while((entry = readdir(dir)) != NULL) {
+        char *name = entry->d_name;
+        size_t len = strlen(name);
+        snprintf(input, sizeof(input), "%s/%s", dir_path, name);
+        if(strncmp(name, "test", 4) == 0 && len > 8 && strcmp(name + len - 4, ".txt") == 0) {
+            snprintf(expected, sizeof(expected), "%s/sol%s", dir_path, name + 4);
+        } else if(len > 10 && strcmp(name + len - 10, "_input.txt") == 0) {
+            snprintf(expected, sizeof(expected), "%s/%.*s_output.txt", dir_path, (int) (len - 10), name);
+        } else {
+            continue;
+        }
+        add_case(corpus, input, expected);
+    }
+    closedir(dir);
+}
+
+double now_millis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Runs a binary on a case, comparing its output with the expected one.
+ * @param path the binary (not null)
+ * @param item (not null)
+ * @param millis where to put the wall time (not null)
+ * @return true if the output matches
+ */
+bool run_case(const char *path, case_t *item, double *millis) {
+    static char block[READ_BLOCK];
+    int out[2];
+    size_t matched = 0;
+    bool same = true;
+    ssize_t n;
+    int status;
+
+    if(pipe(out) != 0) return false;
+    double start = now_millis();
+    pid_t pid = fork();
+    if(pid == 0) {
+        int in = open(item->input, O_RDONLY);
+        dup2(in, 0);
+        dup2(out[1], 1);
+        close(out[0]);
+        close(out[1]);
+        execl(path, path, (char *) NULL);
+        _exit(127);
+    }
+    close(out[1]);
+    while((n = read(out[0], block, READ_BLOCK)) > 0) {
+        if(same && (matched + n > item->expected_len || memcmp(item->expected + matched, block, n) != 0)) same = false;
+        matched += n;
+    }
+    close(out[0]);
+    waitpid(pid, &status, 0);
+    *millis = now_millis() - start;
+    return same && matched == item->expected_len && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+void usage() {
+    fputs("usage: edu_corpus [-n repeats] [-m min_ms] -b name=binary [-b name=binary...] corpus_dir...\n"
+          "Runs every binary once on the corpus and checks the outputs, then times them on the cases the first\n"
+          "binary takes at least min_ms on (smaller ones only measure fork/exec): in each repeat the binaries take\n"
+          "turns on every case. Reports the median total of each binary over the repeats, the spread of the\n"
+          "totals, its speedup against the first (median and range of the per repeat ratios), and the fastest\n"
+          "correct binary only if it is faster than every other one in every repeat.\n", stderr);
+}
+
+/**
+ * @param values (not null, sorted in place)
+ * @param count
+ * @return the median
+ */
+double median(double *values, int count) {
+    qsort(values, count, sizeof(double), compare_double);
+    return values[count / 2];
+}
+
+/**
+ * Runs a binary on a case, reporting the first wrong output it gives on it.
+ * @param binary (not null)
+ * @param item (not null)
+ * @param wrong whether the binary already failed on the case (not null)
+ * @return the wall time
+ */
+double check_case(binary_t *binary, case_t *item, bool *wrong) {
+    double millis;
+    if(!run_case(binary->path, item, &millis) && !*wrong) {
+        *wrong = true;
+        binary->failed++;
+        fprintf(stderr, "%s: wrong output on %s\n", binary->name, item->input);
+    }
+    return millis;
+}
+
+int main(int argc, char *argv[]) {
+    binary_t binaries[MAX_BINARIES];
+    int binary_count = 0;
+    int repeats = 3;
+    double min_millis = 0;
+    corpus_t corpus = {0, 0, NULL};
+
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            repeats = atoi(argv[++i]);
+            if(repeats < 1) repeats = 1;
+        } else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            min_millis = atof(argv[++i]);
+        } else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc && binary_count < MAX_BINARIES) {
+            char *spec = argv[++i];
+            char *eq = strchr(spec, '=');
+            binaries[binary_count].name = spec;
+            binaries[binary_count].path = spec;
+            if(eq != NULL) {
+                *eq = '\0';
+                binaries[binary_count].path = eq + 1;
+            }
+            binaries[binary_count].failed = 0;
+            binary_count++;
+        } else {
+            load_dir(&corpus, argv[i]);
+        }
+    }
+    if(binary_count == 0 || corpus.size == 0) {
+        usage();
+        return 2;
+    }
+
+    bool *wrong = (bool *) calloc(binary_count * corpus.size, sizeof(bool));
+    bool *timed = (bool *) calloc(corpus.size, sizeof(bool));
+    int timed_count = 0;
+    for(int c = 0; c < corpus.size; c++) {
+        for(int b = 0; b < binary_count; b++) {
+            double millis = check_case(&binaries[b], &corpus.cases[c], &wrong[b * corpus.size + c]);
+            if(b == 0 && millis >= min_millis) {
+                timed[c] = true;
+                timed_count++;
+            }
+        }
+    }
+
+    // the binaries take turns, starting from a different one on every case and repeat, so a slower stretch of
+    // the machine is shared by all of them instead of landing on the ones run in it
+    for(int b = 0; b < binary_count; b++) binaries[b].totals = (double *) calloc(repeats, sizeof(double));
+    for(int r = 0; r < repeats; r++) {
+        for(int c = 0; c < corpus.size; c++) {
+            if(!timed[c]) continue;
+            for(int k = 0; k < binary_count; k++) {
+                int b = (k + r + c) % binary_count;
+                binaries[b].totals[r] += check_case(&binaries[b], &corpus.cases[c], &wrong[b * corpus.size + c]);
+            }
+        }
+    }
+
+    double *sorted = (double *) malloc(repeats * sizeof(double));
+    int fastest = -1;
+    printf("%d cases, %d timed (at least %.1fms on %s), %d repeats\n", corpus.size, timed_count, min_millis,
+           binaries[0].name, repeats);
+    printf("%-16s %6s %12s %8s %8s %15s\n", "profile", "failed", "time(ms)", "spread", "speedup", "range");
+    for(int b = 0; b < binary_count; b++) {
+        memcpy(sorted, binaries[b].totals, repeats * sizeof(double));
+        double time = median(sorted, repeats);
+        binaries[b].slowest = sorted[repeats - 1];
+        binaries[b].quickest = sorted[0];
+        for(int r = 0; r < repeats; r++) sorted[r] = binaries[0].totals[r] / binaries[b].totals[r];
+        double speedup = median(sorted, repeats);
+        printf("%-16s %6d %12.2f %7.1f%% %7.2fx %6.2fx - %.2fx\n", binaries[b].name, binaries[b].failed, time,
+               100 * (binaries[b].slowest - binaries[b].quickest) / time, speedup, sorted[0], sorted[repeats - 1]);
+        if(binaries[b].failed == 0 && (fastest < 0 || binaries[b].slowest < binaries[fastest].slowest)) fastest = b;
+    }
+    // a winner must be faster in its slowest repeat than every other correct binary in its quickest one
+    for(int b = 0; fastest >= 0 && b < binary_count; b++) {
+        if(b != fastest && binaries[b].failed == 0 && binaries[b].quickest <= binaries[fastest].slowest) fastest = -1;
+    }
+    if(fastest >= 0) printf("fastest correct profile: %s (%s)\n", binaries[fastest].name, binaries[fastest].path);
+    else printf("no correct profile is faster than the others beyond the spread of the repeats\n");
+    free(sorted);
+    free(timed);
+    free(wrong);
+    int failed = 0;
+    for(int b = 0; b < binary_count; b++) {
+        free(binaries[b].totals);
+        failed += binaries[b].failed;
+    }
+    return failed > 0 ? 1 : 0;
+}
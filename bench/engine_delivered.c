@@ -0,0 +1,5 @@
+/*
+ * delivered.c as an in-process engine: its main becomes edu_delivered_main.
+ */
+#define main edu_delivered_main
+#include "../delivered.c"
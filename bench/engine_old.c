@@ -0,0 +1,11 @@
+/*
+ * old_version_did_not_pass.c as an in-process engine: its main becomes edu_old_main and the
+ * functions that share a name with delivered.c get an old_ prefix.
+ */
+#define main edu_old_main
+#define handle_change old_handle_change
+#define handle_delete old_handle_delete
+#define handle_print old_handle_print
+#define parse_cmd old_parse_cmd
+#define redo_change old_redo_change
+#include "../old_version_did_not_pass.c"
@@ -0,0 +1,592 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <setjmp.h>
+#include <signal.h>
+
+#define INIT_VERSIONS_LEN 1000
+#define INCREASE_CONST 1000
+#define PATH_LEN 4096
+
+int edu_delivered_main(int argc, char *argv[]);
+int edu_old_main();
+extern bool print_cache_on;
+
+/**
+ * Commands a stream may use: the ones of old_version_did_not_pass.c (c/d/p/u/r), every command of the
+ * linear engine, or also the ones only tree mode has (b and j).
+ */
+enum stream_level {CLASSIC, FULL, BRANCHING};
+
+/**
+ * Engine run in-process on a stream: stdin and stdout are swapped with memory streams around it.
+ * It runs the streams up to its level; tree mode numbers versions in creation order, so the outputs naming
+ * versions are only compared between engines with the same numbering. ran is false if the last stream was
+ * above its level, split if its output had the lines expected: then ends are the ends of the outputs of its commands.
+ */
+typedef struct engine_s {
+    const char *name;
+    int (*run)();
+    enum stream_level level;
+    bool tree;
+    char *output;
+    size_t output_len;
+    size_t *ends;
+    double millis;
+    bool ran;
+    bool split;
+    bool crashed;
+}engine_t;
+
+/**
+ * The versions created so far, in creation order (the ids of tree mode), enough to generate only valid commands:
+ * the size of each one (a change can start at most one line past the end), its parent and depth for undo and
+ * redo, and its children for the branches b lists. Redo goes towards tip, the last version made or jumped to.
+ */
+typedef struct model_s {
+    int *sizes;
+    int *parents;
+    int *depths;
+    int *children;
+    int capacity;
+    int count;
+    int curr;
+    int tip;
+}model_t;
+
+/**
+ * Output of a command of a stream: lines lines, or every line up to a "." one if lines is negative.
+ */
+typedef struct segment_s {
+    int lines;
+    bool versioned;
+}segment_t;
+
+/**
+ * A generated stream, with the outputs its commands are expected to have.
+ */
+typedef struct stream_s {
+    char *text;
+    size_t len;
+    enum stream_level level;
+    segment_t *segments;
+    int count;
+    int capacity;
+}stream_t;
+
+typedef struct options_s {
+    unsigned long long seed;
+    int streams;
+    int max_commands;
+    int max_lines;
+    double ratio;
+    double min_millis;
+    char *fixtures;
+    // the highest level of the streams
+    enum stream_level max_level;
+}options_t;
+
+/**
+ * Runs delivered.c in-process: its flags are globals, left set by the run before, so they are reset first.
+ * @param argc
+ * @param argv (not null)
+ * @return the exit status of the engine
+ */
+int run_edu(int argc, char *argv[]) {
+    print_cache_on = false;
+    return edu_delivered_main(argc, argv);
+}
+
+int run_delivered() {
+    char *argv[] = {"edu_api", NULL};
+    return run_edu(1, argv);
+}
+
+int run_delivered_cache() {
+    char *argv[] = {"edu_api", "--print-cache", NULL};
+    return run_edu(2, argv);
+}
+
+int run_delivered_snapshots() {
+    char *argv[] = {"edu_api", "--snapshots", "always", NULL};
+    return run_edu(3, argv);
+}
+
+int run_delivered_tree() {
+    char *argv[] = {"edu_api", "--tree", NULL};
+    return run_edu(2, argv);
+}
+
+int run_old() {
+    return edu_old_main();
+}
+
+unsigned long long rng_state;
+sigjmp_buf crash_jump;
+
+void on_crash(int sig) {
+    siglongjmp(crash_jump, sig);
+}
+
+unsigned long long next_rand() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @param bound
+ * @return a random number in [0, bound)
+ */
+int rand_below(int bound) {
+    return bound <= 1 ? 0 : (int) (next_rand() % (unsigned long long) bound);
+}
+
+double now_millis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Records a new version after an edit or a batch, child of the current one, which it becomes.
+ * @param model (not null)
+ * @param size the size of the new version
+ */
+void model_push(model_t *model, int size) {
+    int id = model->count++;
+    if(id >= model->capacity) {
+        model->capacity = id + INCREASE_CONST;
+        model->sizes = (int *) realloc(model->sizes, model->capacity * sizeof(int));
+        model->parents = (int *) realloc(model->parents, model->capacity * sizeof(int));
+        model->depths = (int *) realloc(model->depths, model->capacity * sizeof(int));
+        model->children = (int *) realloc(model->children, model->capacity * sizeof(int));
+    }
+    model->sizes[id] = size;
+    model->parents[id] = id == 0 ? 0 : model->curr;
+    model->depths[id] = id == 0 ? 0 : model->depths[model->curr] + 1;
+    model->children[id] = 0;
+    if(id > 0) model->children[model->curr]++;
+    model->curr = model->tip = id;
+}
+
+/**
+ * @param model (not null)
+ * @param version
+ * @param depth at most the depth of version
+ * @return the ancestor of version at depth
+ */
+int model_ancestor(model_t *model, int version, int depth) {
+    while(model->depths[version] > depth) version = model->parents[version];
+    return version;
+}
+
+/**
+ * Records the output expected from the next command.
+ * @param stream (not null)
+ * @param lines the number of lines, negative if ended by a "." line
+ * @param versioned whether it names versions
+ */
+void expect(stream_t *stream, int lines, bool versioned) {
+    if(stream->count >= stream->capacity) {
+        stream->capacity = stream->capacity == 0 ? INIT_VERSIONS_LEN : 2 * stream->capacity;
+        stream->segments = (segment_t *) realloc(stream->segments, stream->capacity * sizeof(segment_t));
+    }
+    stream->segments[stream->count++] = (segment_t) {lines, versioned};
+}
+
+void write_text_line(FILE *out) {
+    static const char *words[] = {"edU", "undo", "redo", "line", "text", "Barry", "bee", "honey", "a", "the",
+                                  "Ooh,", "black", "and", "yellow!", "-", "...", "42", "permanent", "snapshot"};
+    int count = 1 + rand_below(rand_below(4) == 0 ? 24 : 8);
+    for(int i = 0; i < count; i++) {
+        fprintf(out, i == 0 ? "%s" : " %s", words[rand_below(sizeof(words) / sizeof(words[0]))]);
+    }
+    fputc('\n', out);
+}
+
+/**
+ * Writes a search: a word of the lines, a piece of one, two words or something no line has.
+ * @param out (not null)
+ */
+void write_search(FILE *out) {
+    static const char *patterns[] = {"edU", "undo", "redo", "line", "honey", "the", "a", "ee", "o", "...",
+                                     "black and", "yellow!", "42", "snap", "Ooh, black", "missing", "zz"};
+    fprintf(out, "/%s\n", patterns[rand_below(sizeof(patterns) / sizeof(patterns[0]))]);
+}
+
+/**
+ * Writes an edit (c, d, i, m or t) on a document of size lines.
+ * @param out (not null)
+ * @param type 0 change, 1 delete, 2 insert, 3 move, 4 copy
+ * @param size
+ * @param width the widest range
+ * @return the size of the document after the edit
+ */
+int write_edit(FILE *out, int type, int size, int width) {
+    int arg1 = 1 + rand_below(size + 1);
+    int arg2 = arg1 + rand_below(width);
+    int to = arg2 > size ? size : arg2;
+    int dest = rand_below(size + 2);
+    switch(type) {
+        case 0:
+            fprintf(out, "%d,%dc\n", arg1, arg2);
+            for(int j = arg1; j <= arg2; j++) write_text_line(out);
+            fputs(".\n", out);
+            return arg2 > size ? arg2 : size;
+        case 1:
+            // possibly out of range
+            fprintf(out, "%d,%dd\n", arg1, arg2);
+            return to >= arg1 ? size - (to - arg1 + 1) : size;
+        case 2:
+            fprintf(out, "%d,%di\n", arg1, arg2);
+            for(int j = arg1; j <= arg2; j++) write_text_line(out);
+            fputs(".\n", out);
+            return size + arg2 - arg1 + 1;
+        case 3:
+            // possibly into its own range, which does nothing
+            fprintf(out, "%d,%d,%dm\n", arg1, arg2, dest);
+            return size;
+        default:
+            fprintf(out, "%d,%d,%dt\n", arg1, arg2, dest);
+            return to >= arg1 ? size + to - arg1 + 1 : size;
+    }
+}
+
+/**
+ * Writes a batch of edits, which makes a single version. Its edits apply in order, each one on the document
+ * left by the previous ones, while the prints in between still see the document before the batch.
+ * A nested { is ignored.
+ * @param out (not null)
+ * @param stream (not null)
+ * @param size the size of the document before the batch
+ * @param width the widest range
+ * @return the size of the document after the batch
+ */
+int write_batch(FILE *out, stream_t *stream, int size, int width) {
+    int edits = rand_below(6), after = size;
+    fputs("{\n", out);
+    for(int i = 0; i < edits; i++) {
+        int pick = rand_below(8);
+        if(pick < 5) {
+            after = write_edit(out, pick, after, width);
+        } else if(pick == 5) {
+            int arg1 = 1 + rand_below(size + 2);
+            int arg2 = arg1 + rand_below(size + 3);
+            fprintf(out, "%d,%dp\n", arg1, arg2);
+            expect(stream, arg2 - arg1 + 1, false);
+        } else if(pick == 6) {
+            fputs("h\n", out);
+            expect(stream, 1, false);
+        } else {
+            fputs("{\n", out);
+        }
+    }
+    fputs("}\n", out);
+    return after;
+}
+
+/**
+ * Generates a random stream of valid commands up to its level, with the output expected from each command.
+ * Every stream draws its own mix of commands, so some are change heavy, some delete heavy and some spend
+ * their time moving through history.
+ * @param options (not null)
+ * @param level
+ * @return the stream
+ */
+stream_t generate_stream(options_t *options, enum stream_level level) {
+    // c d p u r, i m t { v,a,bp x / h }, b j
+    static const enum stream_level needs[] = {CLASSIC, CLASSIC, CLASSIC, CLASSIC, CLASSIC, FULL, FULL, FULL,
+                                              FULL, FULL, FULL, FULL, FULL, BRANCHING, BRANCHING};
+    enum {TYPES = sizeof(needs) / sizeof(needs[0])};
+    stream_t stream = {NULL, 0, level, NULL, 0, 0};
+    FILE *out = open_memstream(&stream.text, &stream.len);
+    model_t model = {NULL, NULL, NULL, NULL, 0, 0, 0, 0};
+    int weights[TYPES], total = 0;
+    int commands = 1 + rand_below(options->max_commands);
+    int width = 1 + rand_below(options->max_lines);
+    int steps = 1 + rand_below(rand_below(2) ? 4 : commands);
+
+    model_push(&model, 0);
+    for(int i = 0; i < TYPES; i++) {
+        weights[i] = needs[i] <= level ? 1 + rand_below(10) : 0;
+        total += weights[i];
+    }
+    for(int i = 0; i < commands; i++) {
+        int pick = rand_below(total), type = 0;
+        int size = model.sizes[model.curr];
+        while(pick >= weights[type]) pick -= weights[type++];
+        if(type == 0 || type == 1) {
+            model_push(&model, write_edit(out, type, size, width));
+        } else if(type == 2) {
+            // print, possibly out of range
+            int arg1 = 1 + rand_below(size + 2);
+            int arg2 = arg1 + rand_below(size + 3);
+            if(rand_below(50) == 0) arg1 = arg2 = 0;
+            fprintf(out, "%d,%dp\n", arg1, arg2);
+            expect(&stream, arg2 - arg1 + 1, false);
+        } else if(type == 3) {
+            int count = 1 + rand_below(steps);
+            int depth = model.depths[model.curr] - count;
+            fprintf(out, "%du\n", count);
+            model.curr = model_ancestor(&model, model.curr, depth < 0 ? 0 : depth);
+        } else if(type == 4) {
+            int count = 1 + rand_below(steps);
+            int depth = model.depths[model.curr] + count;
+            fprintf(out, "%dr\n", count);
+            model.curr = model_ancestor(&model, model.tip, depth > model.depths[model.tip] ? model.depths[model.tip] : depth);
+        } else if(type <= 7) {
+            model_push(&model, write_edit(out, type - 3, size, width));
+        } else if(type == 8) {
+            // a } without a batch is ignored
+            if(rand_below(20) == 0) fputs("}\n", out);
+            model_push(&model, write_batch(out, &stream, size, width));
+        } else if(type == 9) {
+            // at any version, possibly past the end of the history
+            int arg1 = 1 + rand_below(size + 2);
+            int arg2 = arg1 + rand_below(size + 3);
+            fprintf(out, "%d,%d,%dp\n", rand_below(model.count + 2), arg1, arg2);
+            expect(&stream, arg2 - arg1 + 1, true);
+        } else if(type == 10) {
+            fprintf(out, "%d,%dx\n", rand_below(model.count + 2), rand_below(model.count + 2));
+            expect(&stream, -1, true);
+        } else if(type == 11) {
+            write_search(out);
+            expect(&stream, -1, true);
+        } else if(type == 12) {
+            fputs("h\n", out);
+            expect(&stream, 1, false);
+        } else if(type == 13) {
+            int tips = 0;
+            for(int v = 0; v < model.count; v++) tips += model.children[v] == 0;
+            fputs("b\n", out);
+            expect(&stream, tips, true);
+        } else {
+            // a version that does not exist is ignored
+            int version = rand_below(model.count + 1);
+            fprintf(out, "%dj\n", version);
+            if(version < model.count) model.curr = model.tip = version;
+        }
+    }
+    // always look at the final document
+    fprintf(out, "1,%dp\nq\n", model.sizes[model.curr] + 1);
+    expect(&stream, model.sizes[model.curr] + 1, false);
+    fclose(out);
+    free(model.sizes);
+    free(model.parents);
+    free(model.depths);
+    free(model.children);
+    return stream;
+}
+
+/**
+ * Splits the output of an engine into the outputs of the commands of the stream.
+ * @param engine (not null)
+ * @param stream (not null)
+ * @return true if the output has exactly the lines expected
+ */
+bool split_output(engine_t *engine, stream_t *stream) {
+    size_t at = 0;
+    engine->ends = (size_t *) realloc(engine->ends, (stream->count + 1) * sizeof(size_t));
+    for(int k = 0; k < stream->count; k++) {
+        int lines = stream->segments[k].lines;
+        for(int n = 0; lines < 0 || n < lines; n++) {
+            char *end = at < engine->output_len ? memchr(engine->output + at, '\n', engine->output_len - at) : NULL;
+            if(end == NULL) return false;
+            size_t start = at;
+            at = end - engine->output + 1;
+            if(lines < 0 && at - start == 2 && engine->output[start] == '.') break;
+        }
+        engine->ends[k] = at;
+    }
+    return at == engine->output_len;
+}
+
+/**
+ * @param engine (not null)
+ * @param k
+ * @return the start of the output of command k
+ */
+size_t segment_start(engine_t *engine, int k) {
+    return k == 0 ? 0 : engine->ends[k - 1];
+}
+
+/**
+ * Compares the output of every command with the first engine before e whose output was split, and which numbers
+ * versions the same way when the command names them.
+ * @param engines (not null)
+ * @param e
+ * @param stream (not null)
+ * @return true if all of them match
+ */
+bool same_output(engine_t *engines, int e, stream_t *stream) {
+    for(int k = 0; k < stream->count; k++) {
+        int ref = 0;
+        while(ref < e && (!engines[ref].split || (stream->segments[k].versioned && engines[ref].tree != engines[e].tree))) ref++;
+        if(ref == e) continue;
+        size_t start = segment_start(&engines[e], k), len = engines[e].ends[k] - start;
+        size_t ref_start = segment_start(&engines[ref], k);
+        if(len != engines[ref].ends[k] - ref_start) return false;
+        if(memcmp(engines[e].output + start, engines[ref].output + ref_start, len) != 0) return false;
+    }
+    return true;
+}
+
+/**
+ * Runs an engine on a stream, collecting its output and its wall time.
+ * A crashing engine is abandoned where it stopped (its memory is leaked) and marked as crashed.
+ * @param engine (not null)
+ * @param stream (not null)
+ * @param len
+ */
+void run_engine(engine_t *engine, char *stream, size_t len) {
+    FILE *saved_in = stdin, *saved_out = stdout;
+    fflush(stdout);
+    stdin = fmemopen(stream, len, "r");
+    stdout = open_memstream(&engine->output, &engine->output_len);
+    double start = now_millis();
+    engine->crashed = sigsetjmp(crash_jump, 1) != 0;
+    if(!engine->crashed) engine->run();
+    fflush(stdout);
+    engine->millis = now_millis() - start;
+    fclose(stdout);
+    fclose(stdin);
+    stdin = saved_in;
+    stdout = saved_out;
+}
+
+void save_file(const char *path, const char *data, size_t len) {
+    FILE *file = fopen(path, "wb");
+    if(file == NULL) {
+        fprintf(stderr, "cannot write %s\n", path);
+        return;
+    }
+    fwrite(data, 1, len, file);
+    fclose(file);
+}
+
+void usage() {
+    fputs("usage: edu_fuzz [-s seed] [-n streams] [-c max_commands] [-l max_lines] [-r ratio] [-m min_ms] [-o fixtures_dir]\n"
+          "                [-k classic|linear|tree]\n"
+          "Runs random streams through delivered.c (linear, --print-cache, --snapshots always and --tree) and\n"
+          "old_version_did_not_pass.c in-process, checks that the outputs of every command match and reports the\n"
+          "time of each engine per stream. Streams use c/d/p/u/r only (all engines), every command of the linear\n"
+          "engine, or also b/j (tree mode only); outputs naming versions are compared between linear engines.\n"
+          "With -o, streams whose slowest/fastest time ratio is at least ratio (and slowest time at least min_ms)\n"
+          "are saved as NAME_input.txt/NAME_output.txt fixtures, mismatching streams are saved as well.\n"
+          "With -k, streams stop at that level (classic: c/d/p/u/r only, which any version of the editor runs).\n", stderr);
+}
+
+int main(int argc, char *argv[]) {
+    static const char *levels[] = {"c/d/p/u/r", "linear", "tree"};
+    char path[PATH_LEN];
+    options_t options = {1, 200, 500, 50, 20.0, 1.0, NULL, BRANCHING};
+    engine_t engines[] = {
+            {"delivered", run_delivered, FULL, false, NULL, 0, NULL, 0, false, false, false},
+            {"cache", run_delivered_cache, FULL, false, NULL, 0, NULL, 0, false, false, false},
+            {"snapshots", run_delivered_snapshots, FULL, false, NULL, 0, NULL, 0, false, false, false},
+            {"tree", run_delivered_tree, BRANCHING, true, NULL, 0, NULL, 0, false, false, false},
+            {"old", run_old, CLASSIC, false, NULL, 0, NULL, 0, false, false, false},
+    };
+    int engine_count = sizeof(engines) / sizeof(engines[0]);
+    int mismatches = 0, saved = 0;
+
+    for(int i = 1; i < argc; i++) {
+        if(i + 1 >= argc) {
+            usage();
+            return 2;
+        }
+        if(strcmp(argv[i], "-s") == 0) options.seed = strtoull(argv[++i], NULL, 10);
+        else if(strcmp(argv[i], "-n") == 0) options.streams = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-c") == 0) options.max_commands = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-l") == 0) options.max_lines = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-r") == 0) options.ratio = atof(argv[++i]);
+        else if(strcmp(argv[i], "-m") == 0) options.min_millis = atof(argv[++i]);
+        else if(strcmp(argv[i], "-o") == 0) options.fixtures = argv[++i];
+        else if(strcmp(argv[i], "-k") == 0) {
+            i++;
+            if(strcmp(argv[i], "classic") == 0) options.max_level = CLASSIC;
+            else if(strcmp(argv[i], "linear") == 0) options.max_level = FULL;
+            else if(strcmp(argv[i], "tree") == 0) options.max_level = BRANCHING;
+            else {
+                usage();
+                return 2;
+            }
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    signal(SIGSEGV, on_crash);
+    signal(SIGBUS, on_crash);
+    signal(SIGABRT, on_crash);
+    signal(SIGFPE, on_crash);
+    printf("%-20s %8s %-9s", "stream", "bytes", "commands");
+    for(int e = 0; e < engine_count; e++) printf(" %10s", engines[e].name);
+    printf(" %8s %s\n", "ratio", "status");
+    for(int i = 0; i < options.streams; i++) {
+        unsigned long long stream_seed = options.seed * 1000003ULL + i;
+        double fastest = 0, slowest = 0;
+        bool same = true;
+
+        rng_state = stream_seed * 0x9E3779B97F4A7C15ULL + 1;
+        // a third of the streams run on every engine
+        enum stream_level level = rand_below(3) == 0 ? CLASSIC : rand_below(4) == 0 ? BRANCHING : FULL;
+        if(level > options.max_level) level = options.max_level;
+        stream_t stream = generate_stream(&options, level);
+        for(int e = 0; e < engine_count; e++) {
+            engines[e].ran = engines[e].split = false;
+            if(engines[e].level < level) continue;
+            run_engine(&engines[e], stream.text, stream.len);
+            engines[e].ran = true;
+            engines[e].split = !engines[e].crashed && split_output(&engines[e], &stream);
+            if(!engines[e].split || !same_output(engines, e, &stream)) same = false;
+            if(fastest == 0 || engines[e].millis < fastest) fastest = engines[e].millis;
+            if(engines[e].millis > slowest) slowest = engines[e].millis;
+        }
+        double ratio = fastest > 0 ? slowest / fastest : 0;
+        bool extreme = ratio >= options.ratio && slowest >= options.min_millis;
+
+        printf("%-20llu %8zu %-9s", stream_seed, stream.len, levels[level]);
+        for(int e = 0; e < engine_count; e++) {
+            if(engines[e].ran) printf(" %8.3fms", engines[e].millis);
+            else printf(" %10s", "-");
+        }
+        printf(" %7.1fx %s", ratio, !same ? "MISMATCH" : extreme ? "extreme" : "ok");
+        for(int e = 0; e < engine_count; e++) {
+            if(engines[e].crashed) printf(" (%s crashed)", engines[e].name);
+        }
+        putchar('\n');
+
+        // fixtures are run like the public tests, by the linear engine
+        if(options.fixtures != NULL && (!same || (extreme && engines[0].ran))) {
+            snprintf(path, PATH_LEN, "%s/%s_%llu_input.txt", options.fixtures, same ? "fuzz" : "mismatch", stream_seed);
+            save_file(path, stream.text, stream.len);
+            if(same) {
+                snprintf(path, PATH_LEN, "%s/fuzz_%llu_output.txt", options.fixtures, stream_seed);
+                save_file(path, engines[0].output, engines[0].output_len);
+                saved++;
+            } else {
+                for(int e = 0; e < engine_count; e++) {
+                    if(!engines[e].ran) continue;
+                    snprintf(path, PATH_LEN, "%s/mismatch_%llu_%s.txt", options.fixtures, stream_seed, engines[e].name);
+                    save_file(path, engines[e].output, engines[e].output_len);
+                }
+            }
+        }
+        if(!same) mismatches++;
+        for(int e = 0; e < engine_count; e++) {
+            if(engines[e].ran) free(engines[e].output);
+        }
+        free(stream.text);
+        free(stream.segments);
+    }
+    for(int e = 0; e < engine_count; e++) free(engines[e].ends);
+    printf("%d streams, %d mismatches, %d fixtures saved\n", options.streams, mismatches, saved);
+    return mismatches > 0 ? 1 : 0;
+}
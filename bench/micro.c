@@ -0,0 +1,370 @@
+/*
+ * Microbenchmarks of the primitives of the linear engine: delivered.c is compiled in, its main becomes
+ * edu_delivered_main, so the functions timed are the ones edu_api runs.
+ */
+#define main edu_delivered_main
+#include "../delivered.c"
+#undef main
+
+#define MAX_CALLS 1024
+#define MAX_LIST 16
+#define MIN_SAMPLE_NANOS 20000
+#define LINE_TEXT_LEN 64
+
+/**
+ * The state of a benchmark at a document size and a range width. A sample times calls calls in a row, each one
+ * on its own copy (docs, commands, wraps, reclaims) prepared before the clock starts.
+ */
+typedef struct fixture_s {
+    int size;
+    int width;
+    int calls;
+    line_t *lines;
+    snapshot_t base;
+    snapshot_t other;
+    snapshot_t docs[MAX_CALLS];
+    command_t commands[MAX_CALLS];
+    command_wrap_t wraps[MAX_CALLS];
+    reclaim_t reclaims[MAX_CALLS];
+    snapshot_t *snapshot_pool;
+    snapshot_t **snapshots;
+    command_t *command_pool;
+    command_t **command_list;
+    char *input;
+    size_t input_len;
+    FILE *saved_in;
+    FILE *saved_out;
+    FILE *sink;
+}fixture_t;
+
+/**
+ * A primitive: prepare sets up the calls of a sample, call is the one timed, finish undoes what they did.
+ */
+typedef struct bench_s {
+    const char *name;
+    void (*prepare)(fixture_t *fixture);
+    void (*call)(fixture_t *fixture, int k);
+    void (*finish)(fixture_t *fixture);
+}bench_t;
+
+/**
+ * Where the results of the calls without side effects go, so that they are not optimized away.
+ */
+volatile int bench_result;
+
+typedef struct options_s {
+    int sizes[MAX_LIST];
+    int size_count;
+    int widths[MAX_LIST];
+    int width_count;
+    int repeats;
+    int warmup;
+    const char *only;
+}options_t;
+
+long long now_nanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @param fixture (not null)
+ * @return the first line of the range of the benchmarks, 1 based: the range sits in the middle of the document
+ */
+int range_start(fixture_t *fixture) {
+    return (fixture->size - fixture->width) / 2 + 1;
+}
+
+/**
+ * Frees the chunks and the tables of a document.
+ * @param document (not null)
+ */
+void drop_document(snapshot_t *document) {
+    if(document->chunks != NULL) release_chunks(document, 0);
+    free(document->chunks);
+    free(document->hashes);
+    memset(document, 0, sizeof(snapshot_t));
+    document->stale = INT_MAX;
+}
+
+/**
+ * Builds the document of size lines (long enough to have their text on the heap), the snapshots and the commands
+ * of the history the benchmarks look at: a snapshot every 2 commands, size of each.
+ * @param fixture (not null)
+ * @param size
+ */
+void fixture_init(fixture_t *fixture, int size) {
+    char text[LINE_TEXT_LEN];
+    fixture->size = size;
+    fixture->lines = (line_t *) malloc(size * sizeof(line_t));
+    for(int i = 0; i < size; i++) {
+        int len = snprintf(text, LINE_TEXT_LEN, "line %d of the document under benchmark\n", i);
+        fixture->lines[i] = make_line(text, len);
+    }
+    drop_document(&fixture->base);
+    write_lines(&fixture->base, 0, fixture->lines, size);
+    drop_document(&fixture->other);
+    copy_editor(&fixture->base, &fixture->other);
+    fixture->snapshot_pool = (snapshot_t *) calloc(size + 1, sizeof(snapshot_t));
+    fixture->snapshots = (snapshot_t **) malloc((size + 1) * sizeof(snapshot_t *));
+    for(int i = 0; i <= size; i++) {
+        fixture->snapshots[i] = &fixture->snapshot_pool[i];
+        fixture->snapshots[i]->index = 2 * i;
+    }
+    fixture->command_pool = (command_t *) calloc(size, sizeof(command_t));
+    fixture->command_list = (command_t **) malloc(size * sizeof(command_t *));
+    for(int i = 0; i < size; i++) fixture->command_list[i] = &fixture->command_pool[i];
+    for(int k = 0; k < MAX_CALLS; k++) drop_document(&fixture->docs[k]);
+}
+
+void fixture_free(fixture_t *fixture) {
+    for(int i = 0; i < fixture->size; i++) free_line(&fixture->lines[i]);
+    free(fixture->lines);
+    drop_document(&fixture->base);
+    drop_document(&fixture->other);
+    free(fixture->snapshot_pool);
+    free(fixture->snapshots);
+    free(fixture->command_pool);
+    free(fixture->command_list);
+    free(fixture->input);
+    fixture->input = NULL;
+}
+
+/**
+ * Makes every call of a sample work on its own copy of the document, sharing its chunks like the editor does
+ * right after a snapshot.
+ * @param fixture (not null)
+ */
+void prepare_copies(fixture_t *fixture) {
+    for(int k = 0; k < fixture->calls; k++) copy_editor(&fixture->base, &fixture->docs[k]);
+}
+
+void finish_copies(fixture_t *fixture) {
+    for(int k = 0; k < fixture->calls; k++) drop_document(&fixture->docs[k]);
+}
+
+/**
+ * Feeds stdin with the lines of a change of width lines for every call.
+ * @param fixture (not null)
+ */
+void prepare_change(fixture_t *fixture) {
+    FILE *input = open_memstream(&fixture->input, &fixture->input_len);
+    for(int k = 0; k < fixture->calls; k++) {
+        for(int i = 0; i < fixture->width; i++) fprintf(input, "changed line %d of call %d\n", i, k);
+        fputs(".\n", input);
+    }
+    fclose(input);
+    fixture->saved_in = stdin;
+    stdin = fmemopen(fixture->input, fixture->input_len, "r");
+    prepare_copies(fixture);
+    for(int k = 0; k < fixture->calls; k++) {
+        fixture->commands[k] = (command_t) {.arg1 = range_start(fixture), .arg2 = range_start(fixture) + fixture->width - 1};
+    }
+}
+
+void call_change(fixture_t *fixture, int k) {
+    handle_change(&fixture->docs[k], &fixture->commands[k]);
+}
+
+void finish_change(fixture_t *fixture) {
+    fclose(stdin);
+    stdin = fixture->saved_in;
+    free(fixture->input);
+    fixture->input = NULL;
+    for(int k = 0; k < fixture->calls; k++) {
+        for(int i = 0; i < fixture->width; i++) free_line(&fixture->commands[k].content_lines[i]);
+        free(fixture->commands[k].content_lines);
+    }
+    finish_copies(fixture);
+}
+
+void call_delete(fixture_t *fixture, int k) {
+    delete_lines(&fixture->docs[k], range_start(fixture), range_start(fixture) + fixture->width - 1);
+}
+
+void prepare_nothing(fixture_t *fixture) {
+    (void) fixture;
+}
+
+void finish_nothing(fixture_t *fixture) {
+    (void) fixture;
+}
+
+void call_copy_editor(fixture_t *fixture, int k) {
+    copy_editor(&fixture->base, &fixture->docs[k]);
+}
+
+void call_pass_to_snapshot(fixture_t *fixture, int k) {
+    pass_to_snapshot(&fixture->docs[k], &fixture->other);
+}
+
+/**
+ * Looks for the snapshot width snapshots back from the last one (of size).
+ * @param fixture (not null)
+ * @param k
+ */
+void call_backward_search(fixture_t *fixture, int k) {
+    int target = fixture->snapshots[fixture->size - fixture->width]->index + (k & 1);
+    bench_result = backward_search_snapshot(fixture->snapshots, fixture->size, target);
+}
+
+/**
+ * Prints go to /dev/null, without the print cache: every call walks the lines.
+ * @param fixture (not null)
+ */
+void prepare_print(fixture_t *fixture) {
+    print_cache_on = false;
+    fixture->saved_out = stdout;
+    stdout = fixture->sink;
+}
+
+void call_print(fixture_t *fixture, int k) {
+    (void) k;
+    handle_print(&fixture->base, range_start(fixture), range_start(fixture) + fixture->width - 1);
+}
+
+void finish_print(fixture_t *fixture) {
+    fflush(stdout);
+    stdout = fixture->saved_out;
+}
+
+/**
+ * Every call cuts off the last width of size commands, from a history of its own.
+ * @param fixture (not null)
+ */
+void prepare_permanent(fixture_t *fixture) {
+    for(int k = 0; k < fixture->calls; k++) {
+        fixture->wraps[k] = (command_wrap_t) {fixture->size, fixture->size, fixture->size, fixture->size, fixture->command_list,
+                                              fixture->size, 1, 1, NULL, {NULL, 0, 0}, {NULL, 0, 0}};
+        fixture->reclaims[k] = (reclaim_t) {0, 0, 0, 0, NULL, 0};
+    }
+}
+
+void call_permanent(fixture_t *fixture, int k) {
+    make_permanent(&fixture->wraps[k], &fixture->reclaims[k], fixture->size / 2, fixture->size, fixture->size - fixture->width);
+}
+
+/**
+ * Times one sample: calls calls in a row.
+ * @param bench (not null)
+ * @param fixture (not null)
+ * @return the nanoseconds per call
+ */
+double run_sample(const bench_t *bench, fixture_t *fixture) {
+    bench->prepare(fixture);
+    long long start = now_nanos();
+    for(int k = 0; k < fixture->calls; k++) bench->call(fixture, k);
+    long long elapsed = now_nanos() - start;
+    bench->finish(fixture);
+    return (double) elapsed / fixture->calls;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Warms up, doubles the calls per sample until a sample takes MIN_SAMPLE_NANOS, then takes the samples and
+ * prints a CSV row: the median, the maximum, the minimum and the mean time of a call.
+ * @param bench (not null)
+ * @param fixture (not null)
+ * @param options (not null)
+ */
+void run_bench(const bench_t *bench, fixture_t *fixture, const options_t *options) {
+    double *samples = (double *) malloc(options->repeats * sizeof(double)), sum = 0;
+    fixture->calls = 1;
+    for(int i = 0; i < options->warmup; i++) run_sample(bench, fixture);
+    while(fixture->calls < MAX_CALLS && run_sample(bench, fixture) * fixture->calls < MIN_SAMPLE_NANOS) fixture->calls *= 2;
+    for(int i = 0; i < options->repeats; i++) {
+        samples[i] = run_sample(bench, fixture);
+        sum += samples[i];
+    }
+    qsort(samples, options->repeats, sizeof(double), compare_doubles);
+    printf("%s,%d,%d,%d,%d,%.1f,%.1f,%.1f,%.1f\n", bench->name, fixture->size, fixture->width, fixture->calls,
+           options->repeats, samples[options->repeats / 2], samples[options->repeats - 1], samples[0], sum / options->repeats);
+    fflush(stdout);
+    free(samples);
+}
+
+/**
+ * Parses a comma separated list of positive numbers.
+ * @param text (not null)
+ * @param list (not null, MAX_LIST long)
+ * @return how many, 0 if the list is not valid
+ */
+int parse_list(const char *text, int *list) {
+    int count = 0;
+    char *end;
+    while(count < MAX_LIST) {
+        long value = strtol(text, &end, 10);
+        if(end == text || value <= 0 || value > INT_MAX / 4) return 0;
+        list[count++] = (int) value;
+        if(*end == '\0') return count;
+        if(*end != ',') return 0;
+        text = end + 1;
+    }
+    return 0;
+}
+
+void usage() {
+    fputs("usage: edu_micro [-n sizes] [-w widths] [-r repeats] [-u warmup] [-f function]\n"
+          "Times the primitives of the linear engine of delivered.c in isolation, on documents of every size\n"
+          "(lines) and ranges of every width (lines, in the middle of the document; widths over the size are\n"
+          "skipped). Sizes and widths are comma separated lists (default 1000,10000,100000 and 1,16,256,4096).\n"
+          "Every combination is warmed up, then sampled repeats times (default 5 and 101); prints a CSV row with\n"
+          "the median, maximum, minimum and mean nanoseconds per call.\n", stderr);
+}
+
+int main(int argc, char *argv[]) {
+    bench_t benches[] = {
+            {"handle_change", prepare_change, call_change, finish_change},
+            {"delete_lines", prepare_copies, call_delete, finish_copies},
+            {"copy_editor", prepare_nothing, call_copy_editor, finish_copies},
+            {"pass_to_snapshot", prepare_copies, call_pass_to_snapshot, finish_copies},
+            {"backward_search_snapshot", prepare_nothing, call_backward_search, finish_nothing},
+            {"handle_print", prepare_print, call_print, finish_print},
+            {"make_permanent", prepare_permanent, call_permanent, finish_nothing},
+    };
+    int bench_count = sizeof(benches) / sizeof(benches[0]);
+    options_t options = {{1000, 10000, 100000}, 3, {1, 16, 256, 4096}, 4, 101, 5, NULL};
+    static fixture_t fixture;
+
+    for(int i = 1; i < argc; i++) {
+        if(i + 1 >= argc) {
+            usage();
+            return 2;
+        }
+        if(strcmp(argv[i], "-n") == 0) options.size_count = parse_list(argv[++i], options.sizes);
+        else if(strcmp(argv[i], "-w") == 0) options.width_count = parse_list(argv[++i], options.widths);
+        else if(strcmp(argv[i], "-r") == 0) options.repeats = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-u") == 0) options.warmup = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-f") == 0) options.only = argv[++i];
+        else {
+            usage();
+            return 2;
+        }
+        if(options.size_count == 0 || options.width_count == 0 || options.repeats < 1 || options.warmup < 0) {
+            usage();
+            return 2;
+        }
+    }
+
+    fixture.sink = fopen("/dev/null", "w");
+    printf("function,size,width,calls,repeats,median_ns,max_ns,min_ns,mean_ns\n");
+    for(int s = 0; s < options.size_count; s++) {
+        fixture_init(&fixture, options.sizes[s]);
+        for(int b = 0; b < bench_count; b++) {
+            if(options.only != NULL && strcmp(options.only, benches[b].name) != 0) continue;
+            for(int w = 0; w < options.width_count; w++) {
+                if(options.widths[w] > options.sizes[s]) continue;
+                fixture.width = options.widths[w];
+                run_bench(&benches[b], &fixture, &options);
+            }
+        }
+        fixture_free(&fixture);
+    }
+    fclose(fixture.sink);
+    return 0;
+}
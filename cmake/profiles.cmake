@@ -0,0 +1,92 @@
+# Builds edu_api in every optimization profile, trains the PGO one on casi_test/level1..4
+# and runs them all through the corpus, reporting the speedup of each against the baseline: delivered.c
+# as of BASELINE_REF (the first commit if empty), built with the same compiler at -O3.
+# Most cases of the corpus take about as long as starting the editor, so the timing only counts the ones of
+# at least 5ms, mostly large c/d/p/u/r streams generated by the fuzzer; the baseline runs twice to show the noise.
+#
+# cmake -DSOURCE_DIR=... -DBINARY_DIR=... -DC_COMPILER=... -DCORPUS_RUNNER=... -DFUZZER=... [-DBASELINE_REF=...]
+#       -P profiles.cmake
+
+set(training ${SOURCE_DIR}/casi_test/level1 ${SOURCE_DIR}/casi_test/level2
+        ${SOURCE_DIR}/casi_test/level3 ${SOURCE_DIR}/casi_test/level4)
+file(GLOB public_tests LIST_DIRECTORIES true ${SOURCE_DIR}/publicTests/*)
+
+# large streams every version of the editor runs, with the output all the engines of the fuzzer agree on
+set(streams ${BINARY_DIR}/streams)
+file(REMOVE_RECURSE ${streams})
+file(MAKE_DIRECTORY ${streams})
+execute_process(COMMAND ${FUZZER} -k classic -s 1 -n 16 -c 5000 -l 1000 -r 0 -m 20 -o ${streams}
+        OUTPUT_QUIET RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "generating the large streams failed")
+endif()
+set(corpus ${training} ${public_tests} ${streams})
+
+function(build_profile name)
+    set(dir ${BINARY_DIR}/${name})
+    execute_process(COMMAND ${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${dir}
+            -DCMAKE_BUILD_TYPE=Release -DCMAKE_C_COMPILER=${C_COMPILER} -DEDU_SANITIZE=OFF ${ARGN}
+            OUTPUT_QUIET RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "configuring profile ${name} failed")
+    endif()
+    execute_process(COMMAND ${CMAKE_COMMAND} --build ${dir} --target edu_api
+            OUTPUT_QUIET RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "building profile ${name} failed")
+    endif()
+endfunction()
+
+# baseline: a single translation unit, built the way the first CMakeLists.txt did
+find_package(Git REQUIRED)
+if(NOT BASELINE_REF)
+    execute_process(COMMAND ${GIT_EXECUTABLE} rev-list --max-parents=0 HEAD WORKING_DIRECTORY ${SOURCE_DIR}
+            OUTPUT_VARIABLE BASELINE_REF OUTPUT_STRIP_TRAILING_WHITESPACE RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "finding the first commit failed")
+    endif()
+endif()
+file(MAKE_DIRECTORY ${BINARY_DIR}/baseline)
+execute_process(COMMAND ${GIT_EXECUTABLE} show ${BASELINE_REF}:delivered.c WORKING_DIRECTORY ${SOURCE_DIR}
+        OUTPUT_FILE ${BINARY_DIR}/baseline/delivered.c RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "reading delivered.c at ${BASELINE_REF} failed")
+endif()
+execute_process(COMMAND ${C_COMPILER} -O3 -DNDEBUG -o ${BINARY_DIR}/baseline/edu_api ${BINARY_DIR}/baseline/delivered.c -lm
+        RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "building the baseline failed")
+endif()
+
+build_profile(release -DEDU_LTO=OFF -DEDU_NATIVE=OFF -DEDU_PGO=)
+build_profile(lto -DEDU_LTO=ON -DEDU_NATIVE=OFF -DEDU_PGO=)
+build_profile(native -DEDU_LTO=OFF -DEDU_NATIVE=ON -DEDU_PGO=)
+
+# PGO: instrumented build, training run, then the optimized build in the same tree
+set(pgo_data ${BINARY_DIR}/pgo/pgo-data)
+file(REMOVE_RECURSE ${pgo_data})
+build_profile(pgo -DEDU_LTO=ON -DEDU_NATIVE=OFF -DEDU_PGO=GENERATE -DEDU_PGO_DIR=${pgo_data})
+execute_process(COMMAND ${CORPUS_RUNNER} -n 1 -b pgo-train=${BINARY_DIR}/pgo/edu_api ${training}
+        OUTPUT_QUIET RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "PGO training run failed")
+endif()
+file(GLOB raw_profiles ${pgo_data}/*.profraw)
+if(raw_profiles)
+    find_program(LLVM_PROFDATA NAMES llvm-profdata REQUIRED)
+    execute_process(COMMAND ${LLVM_PROFDATA} merge -output=${pgo_data}/edu.profdata ${raw_profiles})
+endif()
+build_profile(pgo -DEDU_LTO=ON -DEDU_NATIVE=OFF -DEDU_PGO=USE -DEDU_PGO_DIR=${pgo_data})
+
+execute_process(COMMAND ${CORPUS_RUNNER} -n 7 -m 5
+        -b baseline=${BINARY_DIR}/baseline/edu_api
+        -b baseline-again=${BINARY_DIR}/baseline/edu_api
+        -b release=${BINARY_DIR}/release/edu_api
+        -b lto=${BINARY_DIR}/lto/edu_api
+        -b native=${BINARY_DIR}/native/edu_api
+        -b pgo+lto=${BINARY_DIR}/pgo/edu_api
+        ${corpus}
+        RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "a profile produced wrong output")
+endif()
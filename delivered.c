@@ -1,41 +1,395 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <time.h>
+#include <ucontext.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 
-#define INPUT_MAX_LENGTH 1025
+#define LINE_ADOPT_MIN 4096
 #define CAPACITY_CONST 100
-#define INIT_SNAP_LEN 1000
+#define INIT_SNAP_LEN 64
 #define INCREASE_CONST 100
 #define INIT_CMD_LEN 1000
 #define INIT_INDEXES_LEN 1000
+#define INIT_BATCH_LEN 16
+#define RECLAIM_BUDGET 64
+#define DOTS_BLOCK 2048
+#define LINE_INLINE_MAX 16
+#define CHUNK_SHIFT 8
+#define CHUNK_LINES (1 << CHUNK_SHIFT)
+#define CHUNK_MASK (CHUNK_LINES - 1)
+#define MAX_REPLAY_THREADS 8
+#define PARALLEL_REPLAY_MIN 65536
+#define MAX_INDEX_BITS 30
+#define OUT_BLOCK 65536
+#define MIN_OUT_BUFFERS 2
+#define FIXED_SHIFT 16
+#define FIXED_ONE (1LL << FIXED_SHIFT)
+#define EWMA_SHIFT 3
+#define DELTA_CHAIN_MAX 64
+#define SESSION_STACK (128 * 1024)
+#define SESSION_INPUT 2048
+#define SESSION_INIT_LEN 16
+#define SESSION_OUT_BLOCK 4096
+#define SESSION_OUT_BUFFERS 4
+#define MAX_EVENTS 256
+#define REGION_RESERVE (64ULL << 20)
+#define REGION_HEAP_MAX (256 << 10)
+#define CHUNK_POOL_RESERVE (1ULL << 40)
+#define CHUNK_POOL_MIN (64ULL << 20)
+#define HUGE_PAGE (2ULL << 20)
+#define DIGEST_BASE 0x9E3779B97F4A7C15ULL
+#define PRINT_CACHE_SLOTS 128
+#define PRINT_CACHE_BYTES (16 << 20)
+#define JOURNAL_SYNC_EVERY 64
+#define JOURNAL_SYNC_MILLIS 10
+#define MAX_READERS 16
+#define READER_JOBS 256
+#define SEARCH_BLOCK_SHIFT 6
+#define SEARCH_BLOOM_LOG 12
+#define SEARCH_BLOOM_WORDS (1 << (SEARCH_BLOOM_LOG - 6))
+#define LINE_TABLE_RESERVE (1ULL << 35)
+#define COLD_DICT 65536
+#define COLD_HASH_BITS 14
+#define COLD_MIN_MATCH 4
+#define COLD_AGE 256
+#define COLD_RAW_MAX (8 << 20)
+#define COLD_BUDGET 64
 
-enum cmd_type {CHANGE, DELETE, PRINT, UNDO, REDO, QUIT, BOTTOM};
+enum cmd_type {CHANGE, DELETE, PRINT, UNDO, REDO, QUIT, BRANCHES, JUMP, DIGEST, PRINT_AT, DIFF, SEARCH, INSERT, MOVE, COPY, BEGIN, COMMIT, BATCH, BOTTOM, INVALID};
 
+/**
+ * Line descriptor (32 bytes): length, hash (0 until a digest needs it), id and, for lines up to LINE_INLINE_MAX
+ * bytes, the text itself.
+ * Longer lines have their text on the heap, found by id in the line table with --cold-pack, in place of the text
+ * otherwise (see line_entry). A slot with len 0 holds no line.
+ * Descriptors are copied by value, the heap text is owned by the command that read it. Every line read gets
+ * the next id, so the id identifies the line in every version holding it and orders the lines by when they were read.
+ */
+typedef struct line_s {
+    unsigned long long hash;
+    unsigned int len;
+    unsigned int id;
+    char text[LINE_INLINE_MAX];
+}line_t;
+
+_Static_assert(sizeof(line_t) == 32, "line descriptors must stay 32 bytes");
+
+/**
+ * Fixed block of CHUNK_LINES consecutive lines, shared between the editor and the snapshots.
+ * A chunk referenced more than once is immutable: the editor copies it before writing (copy on write).
+ */
+typedef struct chunk_s {
+    int refs;
+    line_t lines[CHUNK_LINES];
+}chunk_t;
+
+/**
+ * Virtual memory reserved once and committed as the array in it grows, so it grows in place.
+ * A movable region that outgrows its reservation is moved with mremap, which moves pages without copying them.
+ * A small movable region is a heap block (reserved 0) until it outgrows REGION_HEAP_MAX.
+ */
+typedef struct region_s {
+    char *base;
+    size_t reserved;
+    size_t committed;
+}region_t;
+
+/**
+ * Source of all the chunks: a region reserved once (with huge pages if asked) that never moves,
+ * freed chunks are kept on a list. Replay threads allocate chunks concurrently, hence the lock.
+ */
+typedef struct chunk_pool_s {
+    pthread_mutex_t lock;
+    region_t region;
+    size_t used;
+    chunk_t *free_list;
+}chunk_pool_t;
+
+/**
+ * An edit recorded by a batch: a change, a delete, an insert, a move or a copy, with the lines read by a change
+ * or an insert. The arguments are bounded by clamp_shift when the batch is applied.
+ */
+typedef struct edit_s {
+    enum cmd_type type;
+    int args[3];
+    line_t *content_lines;
+}edit_t;
+
+/**
+ * The edits read between { and }, applied together as a single version by }.
+ * The lines they read have ids from line_begin on.
+ */
+typedef struct batch_s {
+    bool open;
+    int size;
+    int capacity;
+    edit_t *edits;
+    unsigned int line_begin;
+}batch_t;
+
+/**
+ * A document: size lines stored in chunks, capacity is the number of chunk slots.
+ * hashes[c] is the rolling hash of the lines of chunk c, the sum of hash * DIGEST_BASE^position over its lines,
+ * and digest the sum over the chunks before stale: writes update both by the difference. A delete shifts every
+ * line after it, so the chunks from there on become stale instead, and are hashed again when a digest is needed.
+ * A document is all stale until its first digest: nothing is hashed unless digests are asked for.
+ * A snapshot is taken by every edit shifting lines: it records the edit in type (DELETE, INSERT, MOVE or COPY) and
+ * arg1..arg3, an insert also owns the lines it read in content_lines; a committed batch (BATCH) owns its edits.
+ * A delta snapshot holds no chunk, only its size: it is the previous snapshot, its segment of changes and the edit;
+ * chain is the cost (in lines written) of rebuilding it from the closest full snapshot.
+ * The lines read by its edit have ids in [line_begin, line_end).
+ */
 typedef struct snapshot_s {
-    char **lines;
+    chunk_t **chunks;
+    unsigned long long *hashes;
+    unsigned long long digest;
+    int stale;
     int size;
     int capacity;
     int index;
+    bool delta;
+    enum cmd_type type;
+    int arg1;
+    int arg2;
+    int arg3;
+    line_t *content_lines;
+    edit_t *batch;
+    int batch_size;
+    unsigned int line_begin;
+    unsigned int line_end;
+    long long chain;
 }snapshot_t;
 
+/**
+ * A change. index_root is the last writer index after the change (covering [0, 2^index_bits)),
+ * index_mark the size of the index node arena before it, width_sum the lines written by all the changes up to it,
+ * segment the first change after the snapshot before it.
+ */
 typedef struct command_s {
     int arg1;
     int arg2;
-    char **content_lines;
+    line_t *content_lines;
+    int segment;
+    int index_root;
+    int index_bits;
+    int index_mark;
+    long long width_sum;
 }command_t;
 
+/**
+ * Node of the last writer index: a persistent segment tree over line positions, one version per change.
+ * A change marks the canonical nodes of its range with tag = 1 + its command index, so the last change
+ * writing a line at a given version is the largest tag on the path from the root to the line.
+ * Node 0 is the empty tree.
+ */
+typedef struct index_node_s {
+    int tag;
+    int max;
+    int left;
+    int right;
+}index_node_t;
+
+/**
+ * The changes, with the arena of their last writer index (only between two snapshots: deletes shift lines),
+ * built up to index_end when a replay or a past version first needs it. The lines of the changes before indexed, and of the inserts up to snapshot indexed_snap, are in the search index.
+ */
 typedef struct command_wrap_s {
     int size;
     int capacity;
+    int indexed;
+    int indexed_snap;
     command_t **commands;
+    int index_end;
+    int node_size;
+    int node_capacity;
+    index_node_t *nodes;
+    region_t command_region;
+    region_t node_region;
 }command_wrap_t;
 
+/**
+ * Part of a replay: the lines in [from, to) whose last writer at the version of root comes after command after.
+ */
+typedef struct replay_job_s {
+    snapshot_t *editor;
+    command_wrap_t *commandWrap;
+    int root;
+    int bits;
+    int after;
+    int from;
+    int to;
+    unsigned long long digest;
+}replay_job_t;
+
 typedef struct {
     enum cmd_type type;
-    int args[2];
+    int args[3];
+    line_t text;
 }cmd;
 
+/**
+ * History cut off by make_permanent whose memory has not been given back yet.
+ * Stale slots are detached lazily and their lines are freed a few at a time.
+ * With reader threads, the lines in the graveyard wait until every print published before epoch has been emitted.
+ */
+typedef struct reclaim_s {
+    int snap_end;
+    int cmd_end;
+    int size;
+    int capacity;
+    command_t *graveyard;
+    unsigned long long epoch;
+}reclaim_t;
+
+/**
+ * Node of a persistent sequence of lines (randomized tree indexed by position).
+ * Nodes are never modified after creation, so versions share all untouched subtrees.
+ * hash is the rolling hash of the subtree (as in snapshot_t, positions counted from its first line)
+ * and power DIGEST_BASE^size, so the hash of a concatenation is computed from its parts.
+ */
+typedef struct tree_node_s {
+    line_t line;
+    unsigned long long hash;
+    unsigned long long power;
+    int size;
+    struct tree_node_s *left;
+    struct tree_node_s *right;
+}tree_node_t;
+
+/**
+ * A version of the undo tree, with the edit (type, arg1..arg3) leading to it from its parent,
+ * or the edits of a batch (BATCH), kept with their lines. The lines read by the versions created
+ * before it have ids below line_end.
+ */
+typedef struct version_s {
+    tree_node_t *root;
+    struct version_s *parent;
+    struct version_s *jump;
+    int depth;
+    int id;
+    int children;
+    enum cmd_type type;
+    int arg1;
+    int arg2;
+    int arg3;
+    edit_t *batch;
+    int batch_size;
+    unsigned int line_end;
+}version_t;
+
+/**
+ * History kept as a tree of versions (tree mode): a change after an undo opens a new branch
+ * instead of deleting the redo history. The lines of the versions before indexed are in the search index.
+ */
+typedef struct undo_tree_s {
+    version_t **versions;
+    int size;
+    int capacity;
+    int indexed;
+    version_t *curr;
+    version_t *tip;
+    region_t region;
+}undo_tree_t;
+
+/**
+ * Output buffer of the ring. Bytes in [sent, len) are waiting to be written.
+ * spliced is the value of output->bytes_out after the last vmsplice of the buffer:
+ * the pipe may still reference its pages until pipe_size more bytes went through it.
+ */
+typedef struct out_buffer_s {
+    char *data;
+    size_t len;
+    size_t sent;
+    bool was_spliced;
+    unsigned long long spliced;
+}out_buffer_t;
+
+/**
+ * Streaming output: a ring of count buffers of block bytes in front of a non blocking fd.
+ * used buffers starting from head are queued, the last one is being filled.
+ * Commands only wait for the consumer when the whole ring is full (back pressure).
+ */
+typedef struct output_s {
+    int fd;
+    int fd_flags;
+    bool splice;
+    bool stats;
+    unsigned long long pipe_size;
+    int count;
+    size_t block;
+    int head;
+    int used;
+    out_buffer_t *buffers;
+    unsigned long long bytes_out;
+    unsigned long long would_block;
+    unsigned long long stalls;
+    unsigned long long remaps;
+    size_t max_pending;
+}output_t;
+
+/**
+ * Running statistics of the workload: exponential moving averages in fixed point (FIXED_ONE is 1).
+ *      * doc_size: lines in the document at a delete
+ *      * change_width: lines written by a change
+ *      * segment_changes: changes between two deletes
+ *      * restore_rate: snapshot restores (undo/redo replays) between two deletes
+ *      * undo_depth: snapshots a restore goes through, plus one
+ * They decide whether a delete keeps a full snapshot or a delta.
+ */
+typedef struct cost_model_s {
+    bool adaptive;
+    bool stats;
+    long long doc_size;
+    long long change_width;
+    long long segment_changes;
+    long long restore_rate;
+    long long undo_depth;
+    int changes;
+    int restores;
+    long long full;
+    long long deltas;
+    long long rebuilt;
+}cost_model_t;
+
+/**
+ * A connection of the session server, running the editor as a coroutine on its own stack.
+ * waiting is the epoll event the coroutine is suspended on; the stack and the output only exist
+ * once the first input arrived, so an idle connection costs this structure.
+ */
+typedef struct session_s {
+    int fd;
+    int waiting;
+    bool eof;
+    bool done;
+    int eof_chars;
+    int in_pos;
+    int in_len;
+    char *stack;
+    output_t *out;
+    const cost_model_t *model;
+    ucontext_t context;
+    char in[SESSION_INPUT];
+}session_t;
+
 typedef struct int_array_s {
     int size;
     int capacity;
@@ -43,305 +397,3731 @@ typedef struct int_array_s {
 }int_array_t;
 
 /**
- * create a new snapshot with editor content
- * @param editor the main editor (not null)
- * @param dest where to copy the editor (not null)
+ * Run of lines of a version compared to a base version: from >= 0 for lines kept from positions
+ * [from, from + len) of the base, from < 0 for lines written since.
+ */
+typedef struct piece_s {
+    int from;
+    int len;
+}piece_t;
+
+/**
+ * A version as a sequence of pieces over a base version, built by applying the edits in between.
+ */
+typedef struct piece_list_s {
+    int size;
+    int capacity;
+    piece_t *pieces;
+}piece_list_t;
+
+/**
+ * Pre-rendered output of a print: the lines arg1..arg2 of the version with the given digest.
+ * The digest only picks the entry, a hit is confirmed by the ids of the count lines printed.
+ */
+typedef struct print_entry_s {
+    bool valid;
+    unsigned long long digest;
+    int arg1;
+    int arg2;
+    int count;
+    int ids_capacity;
+    unsigned int *ids;
+    size_t len;
+    size_t capacity;
+    char *data;
+}print_entry_t;
+
+/**
+ * Trigram signatures of the lines by id: block b covers the lines with id >> SEARCH_BLOCK_SHIFT == b, and has
+ * bit trigram_bit(t) of its SEARCH_BLOOM_LOG bits set for every trigram t in their text. Lines never change once
+ * read, so the signature of a line is added once: a search first adds the lines of the changes made since the
+ * previous one, which keeps reading changes free when nothing is searched. failed is set if the region could
+ * not grow: no block is skipped then.
+ */
+typedef struct search_index_s {
+    region_t region;
+    unsigned int next_id;
+    bool failed;
+}search_index_t;
+
+search_index_t search_index = {{NULL, 0, 0}, 0, false};
+
+/**
+ * The long lines of a change packed by cold_pack: the change read count lines, with ids from first_id on and
+ * lengths lens. The raw_len bytes of text of its long lines, in order, are coded by cold_encode against the
+ * first dict_len bytes of the dictionary, in the len bytes after lens. alive counts the lines not freed yet.
+ */
+typedef struct cold_block_s {
+    unsigned int first_id;
+    int count;
+    int alive;
+    unsigned int raw_len;
+    unsigned int dict_len;
+    unsigned int len;
+    unsigned int lens[];
+}cold_block_t;
+
+/**
+ * The text of the lines longer than LINE_INLINE_MAX, and the packing of cold history, with --cold-pack (on).
+ * texts[id] is the heap text of line id or, once packed, the address of its cold_block_t + 1 (blocks are aligned,
+ * the low bit tells them apart): descriptors are copied all over the history, the line table is the one place
+ * their text can move. It is reserved once and never moves, since reader threads read it.
+ * Blocks are coded with an LZ77 code whose window starts with a dictionary shared by all of them, the first
+ * COLD_DICT bytes of text ever packed: it only grows, so a block stays valid as it does. table holds the last
+ * dictionary position of every hash of 4 bytes, recent the last position in the text being coded, modulo 65536
+ * (see cold_encode). raw is the bytes of heap text not packed, live the number of blocks, the others are totals
+ * for --cost-stats.
+ */
+typedef struct cold_store_s {
+    bool on;
+    region_t region;
+    uintptr_t *texts;
+    int dict_len;
+    long long raw;
+    long long live;
+    long long packs;
+    long long thaws;
+    long long raw_bytes;
+    long long packed_bytes;
+    unsigned short table[1 << COLD_HASH_BITS];
+    unsigned short recent[1 << COLD_HASH_BITS];
+    unsigned char dictionary[COLD_DICT];
+}cold_store_t;
+
+cold_store_t cold_store = {false, {NULL, 0, 0}, NULL, 0, 0, 0, 0, 0, 0, 0, {0}, {0}, {0}};
+
+/**
+ * A version of the linear engine pinned for the readers: a copy of the editor sharing its chunks, which the editor
+ * copies before writing from then on. It is freed by the writer once the prints of its jobs have been emitted.
+ */
+typedef struct pin_s {
+    snapshot_t document;
+    int jobs;
+    struct pin_s *next;
+}pin_t;
+
+/**
+ * A print handed to the readers: the range of a pinned version (pin, or root in tree mode, where every version
+ * is immutable anyway), and the output rendered by the reader that claimed it.
+ */
+typedef struct print_job_s {
+    pin_t *pin;
+    tree_node_t *root;
+    int arg1;
+    int arg2;
+    size_t len;
+    size_t capacity;
+    char *data;
+    atomic_int done;
+}print_job_t;
+
+/**
+ * Reader threads rendering prints while the writer (the editor loop) goes on with the next commands.
+ * The writer fills the next slot of the ring and publishes it by moving published forward, readers claim the
+ * published slots in order through claimed, without ever touching the editor. The writer emits the outputs in
+ * order, so emitted is the epoch all readers are past: what was retired before a print was published (pinned
+ * versions, lines of dead commands) is only freed by the writer once that print has been emitted.
+ */
+typedef struct readers_s {
+    pthread_t threads[MAX_READERS];
+    int count;
+    print_job_t jobs[READER_JOBS];
+    atomic_ullong published;
+    atomic_ullong claimed;
+    unsigned long long emitted;
+    atomic_int sleeping;
+    atomic_bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pin_t *pins;
+}readers_t;
+
+/**
+ * The reader threads, NULL when prints are rendered by the editor loop.
+ */
+readers_t *readers = NULL;
+
+/**
+ * The job a reader thread is rendering: emit appends to it.
+ */
+_Thread_local print_job_t *render = NULL;
+
+/**
+ * Append-only journal of the commands that change the history (edits, undos, redos, jumps and batches), in the
+ * input format with the lines they read. Complete records gather in buf (the header of a change or an insert
+ * waits in header until its lines are read) and a group is written with a single fdatasync once sync_every
+ * commands are pending, when the editor quits, or by the flusher thread once the oldest pending one is
+ * sync_millis old, whether or not more input comes. lock guards buf and the counters between the two threads.
+ * A journal found at startup is read back first: replay is its mapping, up to the last complete record, which
+ * the editor reads before stdin.
+ */
+typedef struct journal_s {
+    int fd;
+    int pending;
+    int sync_every;
+    long long sync_millis;
+    long long first_pending;
+    bool recording;
+    char header[48];
+    int header_len;
+    pthread_t flusher;
+    bool timed;
+    bool closing;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    size_t len;
+    size_t capacity;
+    char *buf;
+    char *replay;
+    size_t replay_len;
+    size_t replay_pos;
+}journal_t;
+
+/**
+ * The journal, NULL if the session is not journaled.
+ */
+journal_t *journal = NULL;
+
+/**
+ * Advise transparent huge pages for the chunks and the arrays.
+ */
+bool huge_pages = false;
+
+/**
+ * Makes the first bytes of a region usable, committing at least twice what was committed.
+ * A movable region stays on the heap up to REGION_HEAP_MAX bytes, most arrays never leave it: reserving and
+ * committing cost more than the copies of realloc. The first call past that reserves the region.
+ * @param region (not null)
+ * @param bytes
+ * @param movable the region may move if it outgrows its reservation
+ * @return the base of the region, NULL if it cannot grow
+ */
+void *region_commit(region_t *region, size_t bytes, bool movable) {
+    if(bytes <= region->committed) return region->base;
+    size_t commit = 2 * region->committed;
+    if(commit < bytes) commit = bytes;
+    if(movable && region->reserved == 0 && bytes <= REGION_HEAP_MAX) {
+        if(commit > REGION_HEAP_MAX) commit = REGION_HEAP_MAX;
+        char *heap = (char *) realloc(region->base, commit);
+        if(heap == NULL) return NULL;
+        region->base = heap;
+        region->committed = commit;
+        return heap;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    // the heap part of the region, copied into the reservation once it is committed
+    char *heap = region->reserved == 0 ? region->base : NULL;
+    size_t copied = region->committed;
+    commit = (commit + page - 1) / page * page;
+    if(region->reserved == 0 || commit > region->reserved) {
+        size_t reserved = region->reserved == 0 ? REGION_RESERVE : 2 * region->reserved;
+        void *base;
+        if(reserved < commit) reserved = commit;
+        if(region->reserved == 0) {
+            base = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        } else if(movable) {
+            base = mremap(region->base, region->reserved, reserved, MREMAP_MAYMOVE);
+        } else {
+            return NULL;
+        }
+        if(base == MAP_FAILED) return NULL;
+        if(huge_pages) madvise(base, reserved, MADV_HUGEPAGE);
+        region->base = (char *) base;
+        region->reserved = reserved;
+        if(heap != NULL) region->committed = 0;
+    }
+    if(mprotect(region->base + region->committed, commit - region->committed, PROT_READ | PROT_WRITE) != 0) return NULL;
+    region->committed = commit;
+    if(heap != NULL) {
+        memcpy(region->base, heap, copied);
+        free(heap);
+    }
+    return region->base;
+}
+
+void region_free(region_t *region) {
+    if(region->base != NULL && region->reserved == 0) free(region->base);
+    else if(region->base != NULL) munmap(region->base, region->reserved);
+    region->base = NULL;
+    region->reserved = 0;
+    region->committed = 0;
+}
+
+/**
+ * Commits the line table through an id, reserving it first: all of it at once if possible, readers may read it
+ * while it grows.
+ * @param id
+ * @return the entry of the line (not null)
+ */
+uintptr_t *line_slot(unsigned int id) {
+    for(size_t reserved = LINE_TABLE_RESERVE; cold_store.region.base == NULL && reserved >= REGION_RESERVE; reserved /= 2) {
+        char *base = (char *) mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(base != MAP_FAILED) cold_store.region = (region_t) {base, reserved, 0};
+    }
+    uintptr_t *texts = (uintptr_t *) region_commit(&cold_store.region, ((size_t) id + 1) * sizeof(uintptr_t), false);
+    if(texts == NULL) {
+        perror("line table");
+        abort();
+    }
+    // set once: the table never moves
+    if(cold_store.texts != texts) cold_store.texts = texts;
+    return &texts[id];
+}
+
+/**
+ * Without cold packing the text of a line never moves: its address is kept in the descriptor, in place of the
+ * inline text, and the line table is not used.
+ * @param line a line longer than LINE_INLINE_MAX (not null)
+ * @return the address of its text or, packed, of its cold_block_t + 1
+ */
+uintptr_t line_entry(const line_t *line) {
+    uintptr_t entry;
+    if(cold_store.on) return cold_store.texts[line->id];
+    memcpy(&entry, line->text, sizeof(entry));
+    return entry;
+}
+
+/**
+ * @param line a line longer than LINE_INLINE_MAX (not null)
+ * @param text the address of its heap text
+ */
+void line_set_text(line_t *line, char *text) {
+    uintptr_t entry = (uintptr_t) text;
+    if(cold_store.on) *line_slot(line->id) = entry;
+    else memcpy(line->text, &entry, sizeof(entry));
+}
+
+/**
+ * Hashes a line 8 bytes at a time (a byte at a time cost as much as reading the line): the last word is the
+ * last 8 bytes, overlapping the one before, shorter lines go a byte at a time. The result is mixed with the
+ * splitmix64 finalizer.
+ * @param text (not null)
+ * @param len
+ * @return the hash of a line
+ */
+unsigned long long line_hash(const char *text, unsigned int len) {
+    unsigned long long hash = 0xCBF29CE484222325ULL ^ len, word = 0;
+    if(len < sizeof(word)) {
+        for(unsigned int i = 0; i < len; i++) word = word << 8 | (unsigned char) text[i];
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+    } else {
+        for(unsigned int i = 0; i + sizeof(word) < len; i += sizeof(word)) {
+            memcpy(&word, text + i, sizeof(word));
+            hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+            hash ^= hash >> 29;
+        }
+        memcpy(&word, text + len - sizeof(word), sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+    }
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 31);
+}
+
+/**
+ * @param text (not null, at least 4 bytes)
+ * @return the slot of its first 4 bytes in the tables of cold_store, by multiplication with the golden ratio
+ */
+unsigned int cold_slot(const unsigned char *text) {
+    unsigned int word;
+    memcpy(&word, text, sizeof(word));
+    return (word * 2654435761u) >> (32 - COLD_HASH_BITS);
+}
+
+unsigned char *cold_put(unsigned char *out, size_t value) {
+    while(value >= 0x80) {
+        *out++ = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char) value;
+    return out;
+}
+
+const unsigned char *cold_get(const unsigned char *in, size_t *value) {
+    int shift = 0;
+    *value = 0;
+    do {
+        *value |= (size_t) (*in & 0x7F) << shift;
+        shift += 7;
+    } while(*in++ & 0x80);
+    return in;
+}
+
+/**
+ * @param a (not null)
+ * @param b (not null)
+ * @param limit
+ * @return the length of the common prefix of a and b, at most limit
+ */
+int cold_extend(const unsigned char *a, const unsigned char *b, int limit) {
+    int length = 0;
+    while(length + 8 <= limit) {
+        unsigned long long x, y;
+        memcpy(&x, a + length, sizeof(x));
+        memcpy(&y, b + length, sizeof(y));
+        // the first byte that differs is the lowest one set in x ^ y (little endian)
+        if(x != y) return length + __builtin_ctzll(x ^ y) / 8;
+        length += 8;
+    }
+    while(length < limit && a[length] == b[length]) length++;
+    return length;
+}
+
+/**
+ * Codes text as LZ77 sequences: a token (literal count << 4 | match length - COLD_MIN_MATCH, 15 meaning that
+ * the rest follows as a varint), the literals, the varint distance of the match and the rest of its length.
+ * The last sequence has literals only. A match may start in the dictionary, the dict_len bytes before text
+ * (and then ends there): its positions are in cold_store.table, the ones of text in cold_store.recent. Entries
+ * left by other texts are only candidates, checked like the others. At most 2 * len + 16 bytes are written.
+ * @param text (not null)
+ * @param len
+ * @param dict_len
+ * @param out (not null)
+ * @return the number of bytes written
+ */
+size_t cold_encode(const unsigned char *text, int len, int dict_len, unsigned char *out) {
+    const unsigned char *dictionary = cold_store.dictionary;
+    unsigned char *start = out;
+    int anchor = 0, i = 0, misses = 0;
+    while(i + COLD_MIN_MATCH <= len) {
+        unsigned int slot = cold_slot(text + i);
+        int candidate = i - (unsigned short) (i - cold_store.recent[slot]), length = 0;
+        size_t distance = 0;
+        cold_store.recent[slot] = (unsigned short) i;
+        if(candidate >= 0 && candidate < i) {
+            length = cold_extend(text + candidate, text + i, len - i);
+            distance = i - candidate;
+        }
+        if(length < COLD_MIN_MATCH && (candidate = cold_store.table[slot]) < dict_len) {
+            int limit = len - i < dict_len - candidate ? len - i : dict_len - candidate;
+            length = cold_extend(dictionary + candidate, text + i, limit);
+            distance = (size_t) (dict_len - candidate) + i;
+        }
+        if(length < COLD_MIN_MATCH) {
+            // text that does not match gets skipped faster and faster
+            i += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+        size_t literals = i - anchor, extra = length - COLD_MIN_MATCH;
+        *out++ = (unsigned char) ((literals < 15 ? literals : 15) << 4 | (extra < 15 ? extra : 15));
+        if(literals >= 15) out = cold_put(out, literals - 15);
+        memcpy(out, text + anchor, literals);
+        out = cold_put(out + literals, distance);
+        if(extra >= 15) out = cold_put(out, extra - 15);
+        i += length;
+        anchor = i;
+        // the end of the match is worth finding later
+        if(i - 2 + COLD_MIN_MATCH <= len) cold_store.recent[cold_slot(text + i - 2)] = (unsigned short) (i - 2);
+    }
+    size_t literals = len - anchor;
+    *out++ = (unsigned char) ((literals < 15 ? literals : 15) << 4);
+    if(literals >= 15) out = cold_put(out, literals - 15);
+    memcpy(out, text + anchor, literals);
+    return out + literals - start;
+}
+
+/**
+ * Decodes what cold_encode wrote.
+ * @param in (not null)
+ * @param len the length of the code
+ * @param dict_len the length of the dictionary it was coded against
+ * @param out where to put the text (not null)
+ */
+void cold_decode(const unsigned char *in, size_t len, size_t dict_len, unsigned char *out) {
+    const unsigned char *end = in + len;
+    size_t at = 0, count, distance;
+    while(in < end) {
+        unsigned char token = *in++;
+        count = token >> 4;
+        if(count == 15) {
+            in = cold_get(in, &distance);
+            count += distance;
+        }
+        memcpy(out + at, in, count);
+        in += count;
+        at += count;
+        if(in >= end) break;
+        in = cold_get(in, &distance);
+        count = token & 15;
+        if(count == 15) {
+            size_t more;
+            in = cold_get(in, &more);
+            count += more;
+        }
+        count += COLD_MIN_MATCH;
+        if(distance > at) {
+            // a match in the dictionary
+            memcpy(out + at, cold_store.dictionary + dict_len - (distance - at), count);
+            at += count;
+            continue;
+        }
+        // byte by byte: the match may overlap what it writes
+        for(size_t j = 0; j < count; j++, at++) out[at] = out[at - distance];
+    }
+}
+
+/**
+ * @param block (not null)
+ * @return the text of the long lines of a block, one after the other (to free)
+ */
+unsigned char *cold_unpack(const cold_block_t *block) {
+    unsigned char *text = (unsigned char *) malloc(block->raw_len);
+    cold_decode((const unsigned char *) (block->lens + block->count), block->len, block->dict_len, text);
+    return text;
+}
+
+/**
+ * Gives the lines of a block still alive their heap text back, and frees the block.
+ * @param block (not null)
+ */
+void cold_thaw(cold_block_t *block) {
+    unsigned char *text = cold_unpack(block);
+    uintptr_t packed = (uintptr_t) block + 1;
+    for(int i = 0, at = 0; i < block->count; i++) {
+        if(block->lens[i] <= LINE_INLINE_MAX) continue;
+        if(cold_store.texts[block->first_id + i] == packed) {
+            char *heap = (char *) malloc(block->lens[i]);
+            memcpy(heap, text + at, block->lens[i]);
+            cold_store.texts[block->first_id + i] = (uintptr_t) heap;
+            cold_store.raw += block->lens[i];
+        }
+        at += block->lens[i];
+    }
+    free(text);
+    free(block);
+    cold_store.live--;
+    cold_store.thaws++;
+}
+
+/**
+ * Creates the descriptor of a line, storing it inline when short enough. It is hashed when a digest first needs it.
+ * @param buff the text of the line (not null)
+ * @param len
+ * @return
+ */
+line_t make_line(const char *buff, unsigned int len) {
+    line_t line;
+    char *heap;
+    line.hash = 0;
+    line.len = len;
+    line.id = search_index.next_id++;
+    if(len <= LINE_INLINE_MAX) {
+        memcpy(line.text, buff, len);
+    } else {
+        heap = (char *) malloc(len * sizeof(char));
+        memcpy(heap, buff, len);
+        line_set_text(&line, heap);
+        cold_store.raw += len;
+    }
+    return line;
+}
+
+/**
+ * Creates the descriptor of a line longer than LINE_INLINE_MAX from a heap buffer holding its text,
+ * which the line takes over (trimmed to len) instead of copying it.
+ * @param heap the text of the line (not null, at least len bytes allocated)
+ * @param len
+ * @return
+ */
+line_t adopt_line(char *heap, unsigned int len) {
+    line_t line;
+    line.hash = 0;
+    line.len = len;
+    line.id = search_index.next_id++;
+    line_set_text(&line, (char *) realloc(heap, len));
+    cold_store.raw += len;
+    return line;
+}
+
+/**
+ * A packed line is unpacked first, with the other lines of its block: only the editor loop may read one.
+ * @param line (not null)
+ * @return the text of the line, not null terminated
+ */
+const char *line_text(const line_t *line) {
+    if(line->len <= LINE_INLINE_MAX) return line->text;
+    uintptr_t text = line_entry(line);
+    if(text & 1) {
+        cold_thaw((cold_block_t *) (text - 1));
+        text = cold_store.texts[line->id];
+    }
+    return (const char *) text;
+}
+
+/**
+ * Hashes a line the first time its hash is needed, reading its text: only the editor loop may call it.
+ * @param line (not null)
+ * @return the hash of the line
+ */
+unsigned long long line_digest(line_t *line) {
+    if(line->hash == 0) line->hash = line_hash(line_text(line), line->len);
+    return line->hash;
+}
+
+/**
+ * Frees the heap text of a line, if any. A packed line leaves its block, freed with the last one.
+ * @param line (not null)
+ */
+void free_line(line_t *line) {
+    if(line->len > LINE_INLINE_MAX) {
+        uintptr_t text = line_entry(line);
+        if(cold_store.on) cold_store.texts[line->id] = 0;
+        if(!(text & 1)) {
+            free((char *) text);
+            cold_store.raw -= line->len;
+        } else if(--((cold_block_t *) (text - 1))->alive == 0) {
+            free((cold_block_t *) (text - 1));
+            cold_store.live--;
+        }
+    }
+    line->len = 0;
+}
+
+/**
+ * Packs the long lines of a change into a single block, freeing their heap text. Nothing happens if the change
+ * has no long line, or they do not get smaller. Text packed while the dictionary is not full is appended to it.
+ * @param lines the lines of the change, with consecutive ids (not null)
+ * @param count
+ * @return the number of bytes of text packed
+ */
+size_t cold_pack(const line_t *lines, int count) {
+    size_t raw = 0;
+    int dict_len = cold_store.dict_len;
+    for(int i = 0; i < count; i++) {
+        if(lines[i].id != lines[0].id + i || (lines[i].len > LINE_INLINE_MAX && (cold_store.texts[lines[i].id] & 1))) return 0;
+        if(lines[i].len > LINE_INLINE_MAX) raw += lines[i].len;
+    }
+    if(raw == 0 || raw > INT_MAX / 4) return 0;
+    unsigned char *text = (unsigned char *) malloc(raw);
+    for(int i = 0, at = 0; i < count; i++) {
+        if(lines[i].len <= LINE_INLINE_MAX) continue;
+        memcpy(text + at, (const char *) cold_store.texts[lines[i].id], lines[i].len);
+        at += lines[i].len;
+    }
+    cold_block_t *block = (cold_block_t *) malloc(sizeof(cold_block_t) + count * sizeof(unsigned int) + 2 * raw + 16);
+    block->len = cold_encode(text, raw, dict_len, (unsigned char *) (block->lens + count));
+    if(block->len + count * sizeof(unsigned int) >= raw) {
+        free(text);
+        free(block);
+        return 0;
+    }
+    block = (cold_block_t *) realloc(block, sizeof(cold_block_t) + count * sizeof(unsigned int) + block->len);
+    block->first_id = lines[0].id;
+    block->count = count;
+    block->alive = 0;
+    block->raw_len = raw;
+    block->dict_len = dict_len;
+    for(int i = 0; i < count; i++) {
+        block->lens[i] = lines[i].len;
+        if(lines[i].len <= LINE_INLINE_MAX) continue;
+        free((char *) cold_store.texts[lines[i].id]);
+        cold_store.texts[lines[i].id] = (uintptr_t) block + 1;
+        cold_store.raw -= lines[i].len;
+        block->alive++;
+    }
+    // the dictionary grows in place: positions already in it never change
+    int grow = raw < (size_t) (COLD_DICT - dict_len) ? (int) raw : COLD_DICT - dict_len;
+    memcpy(cold_store.dictionary + dict_len, text, grow);
+    cold_store.dict_len += grow;
+    for(int i = dict_len > COLD_MIN_MATCH ? dict_len - COLD_MIN_MATCH + 1 : 0; i + COLD_MIN_MATCH <= cold_store.dict_len; i++) {
+        cold_store.table[cold_slot(cold_store.dictionary + i)] = (unsigned short) i;
+    }
+    free(text);
+    cold_store.live++;
+    cold_store.packs++;
+    cold_store.raw_bytes += raw;
+    cold_store.packed_bytes += block->len;
+    return raw;
+}
+
+/**
+ * The streaming output, NULL to write through stdio.
+ */
+output_t *output = NULL;
+
+/**
+ * The running session of the server, NULL when the editor reads stdin.
+ */
+session_t *session = NULL;
+
+ucontext_t loop_context;
+
+/**
+ * Suspends the running session until the event loop sees events on its connection.
+ * @param events EPOLLIN or EPOLLOUT
+ */
+void session_wait(int events) {
+    session->waiting = events;
+    swapcontext(&session->context, &loop_context);
+}
+
+/**
+ * Waits until the fd of an output accepts more bytes: a session gives control back to the event loop.
+ * @param out (not null)
+ */
+void out_wait(output_t *out) {
+    if(session != NULL) {
+        session_wait(EPOLLOUT);
+    } else {
+        struct pollfd wait = {out->fd, POLLOUT, 0};
+        poll(&wait, 1, -1);
+    }
+}
+
+/**
+ * @param size
+ * @return a page aligned buffer, that can be handed to vmsplice
+ */
+char *out_map(size_t size) {
+    char *data = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+/**
+ * Opens the streaming output on fd, switching it to non blocking mode.
+ * vmsplice is only used if requested and fd is a pipe.
+ * @param fd
+ * @param count number of buffers of the ring
+ * @param block size of a buffer (a multiple of the page size)
+ * @param splice
+ * @param stats print the back pressure counters on stderr when closing
+ * @return the output, NULL if it cannot be opened (stdio is used instead)
+ */
+output_t *out_open(int fd, int count, size_t block, bool splice, bool stats) {
+    struct stat info;
+    output_t *out = (output_t *) calloc(1, sizeof(output_t));
+    if(count < MIN_OUT_BUFFERS) count = MIN_OUT_BUFFERS;
+    out->fd = fd;
+    out->fd_flags = fcntl(out->fd, F_GETFL);
+    out->stats = stats;
+    out->count = count;
+    out->block = block;
+    out->buffers = (out_buffer_t *) calloc(count, sizeof(out_buffer_t));
+    for(int i = 0; i < count; i++) {
+        out->buffers[i].data = out_map(block);
+        if(out->buffers[i].data == NULL) out->fd_flags = -1;
+    }
+    if(out->fd_flags < 0 || fcntl(out->fd, F_SETFL, out->fd_flags | O_NONBLOCK) < 0) {
+        for(int i = 0; i < count; i++) {
+            if(out->buffers[i].data != NULL) munmap(out->buffers[i].data, block);
+        }
+        free(out->buffers);
+        free(out);
+        return NULL;
+    }
+    if(splice && fstat(out->fd, &info) == 0 && S_ISFIFO(info.st_mode)) {
+        int pipe_size = fcntl(out->fd, F_GETPIPE_SZ);
+        out->splice = pipe_size > 0;
+        out->pipe_size = pipe_size;
+    }
+    out->used = 1;
+    return out;
+}
+
+/**
+ * Writes as much of the queued bytes as the fd accepts.
+ * @param out (not null)
+ * @param block wait until the head buffer is written (if it is not the one being filled)
+ * @return false on a write error
+ */
+bool out_pump(output_t *out, bool block) {
+    while(out->used > 0) {
+        out_buffer_t *buffer = &out->buffers[out->head];
+        ssize_t n = 0;
+        if(buffer->sent < buffer->len) {
+            if(out->splice) {
+                struct iovec iov = {buffer->data + buffer->sent, buffer->len - buffer->sent};
+                n = vmsplice(out->fd, &iov, 1, SPLICE_F_NONBLOCK);
+                if(n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    // the kernel refuses it for this fd, fall back to write
+                    out->splice = false;
+                    continue;
+                }
+                if(n > 0) {
+                    buffer->was_spliced = true;
+                    buffer->spliced = out->bytes_out + n;
+                }
+            } else {
+                n = write(out->fd, buffer->data + buffer->sent, buffer->len - buffer->sent);
+            }
+            if(n < 0) {
+                if(errno == EINTR) continue;
+                if(errno != EAGAIN) return false;
+                out->would_block++;
+                if(!block || out->used == 1) return true;
+                // back pressure: the ring is full, wait for the consumer
+                out->stalls++;
+                out_wait(out);
+                continue;
+            }
+            buffer->sent += n;
+            out->bytes_out += n;
+        }
+        if(buffer->sent < buffer->len) {
+            // partial write
+            if(block && out->used > 1) continue;
+            return true;
+        }
+        // the buffer being filled stays in the ring
+        if(out->used == 1) return true;
+        buffer->len = 0;
+        buffer->sent = 0;
+        out->head = (out->head + 1) % out->count;
+        out->used--;
+        block = false;
+    }
+    return true;
+}
+
+/**
+ * Queues bytes, moving to the next buffer of the ring when the current one is full.
+ * @param out (not null)
+ * @param data (not null)
+ * @param len
+ */
+void out_write(output_t *out, const char *data, size_t len) {
+    while(len > 0) {
+        out_buffer_t *buffer = &out->buffers[(out->head + out->used - 1) % out->count];
+        size_t space = out->block - buffer->len;
+        if(space == 0) {
+            if(out->used == out->count) out_pump(out, true);
+            if(out->used == out->count) {
+                // write error, drop the output as stdio would
+                buffer->len = buffer->sent = 0;
+                continue;
+            }
+            buffer = &out->buffers[(out->head + out->used) % out->count];
+            if(buffer->was_spliced && out->bytes_out - buffer->spliced < out->pipe_size) {
+                // the pipe may still hold its pages: give them to the pipe and take new ones
+                char *data = out_map(out->block);
+                if(data == NULL) {
+                    out_pump(out, true);
+                    continue;
+                }
+                munmap(buffer->data, out->block);
+                buffer->data = data;
+                out->remaps++;
+            }
+            buffer->was_spliced = false;
+            out->used++;
+            size_t pending = (out->used - 1) * out->block;
+            if(pending > out->max_pending) out->max_pending = pending;
+            continue;
+        }
+        if(space > len) space = len;
+        memcpy(buffer->data + buffer->len, data, space);
+        buffer->len += space;
+        data += space;
+        len -= space;
+    }
+}
+
+/**
+ * @param out (not null)
+ * @return true if some bytes are still waiting to be written
+ */
+bool out_pending(output_t *out) {
+    return out->used > 1 || out->buffers[out->head].sent < out->buffers[out->head].len;
+}
+
+/**
+ * Writes everything that is queued, restores the fd and frees the output.
+ * @param out (not null)
+ */
+void out_close(output_t *out) {
+    while(out_pending(out)) {
+        if(!out_pump(out, true)) break;
+        if(out->used == 1 && out_pending(out)) out_wait(out);
+    }
+    fcntl(out->fd, F_SETFL, out->fd_flags);
+    if(out->stats) {
+        fprintf(stderr, "output: %llu bytes, %d buffers%s, %llu would block, %llu stalls, %llu remaps, %zu max pending\n",
+                out->bytes_out, out->count, out->splice ? " (vmsplice)" : "", out->would_block, out->stalls,
+                out->remaps, out->max_pending);
+    }
+    for(int i = 0; i < out->count; i++) munmap(out->buffers[i].data, out->block);
+    free(out->buffers);
+    free(out);
+}
+
+/**
+ * Cache of the outputs of print, keyed by version digest and range (direct mapped).
+ */
+print_entry_t print_cache[PRINT_CACHE_SLOTS];
+
+bool print_cache_on = false;
+
+/**
+ * Bytes allocated by the entries of the cache, at most PRINT_CACHE_BYTES.
+ */
+size_t print_cache_bytes = 0;
+
+/**
+ * The entry a print is being rendered into, NULL when emit writes straight to the output.
+ */
+print_entry_t *capture = NULL;
+
+/**
+ * Ids of the lines of the print being looked up in the cache, in order.
+ */
+unsigned int *print_ids = NULL;
+
+int print_ids_capacity = 0;
+
+/**
+ * Writes bytes to the streaming output if open, to stdout otherwise.
+ * @param data (not null)
+ * @param len
+ */
+void emit_out(const char *data, size_t len) {
+    if(output != NULL) out_write(output, data, len);
+    else fwrite(data, 1, len, stdout);
+}
+
+/**
+ * Emits the prints the readers have finished, in order, and releases the versions they pinned.
+ * @param pool (not null)
+ * @param wait wait for every published print, instead of stopping at the first unfinished one
+ */
+void readers_collect(readers_t *pool, bool wait) {
+    while(pool->emitted < atomic_load_explicit(&pool->published, memory_order_relaxed)) {
+        print_job_t *job = &pool->jobs[pool->emitted % READER_JOBS];
+        if(!atomic_load_explicit(&job->done, memory_order_acquire)) {
+            if(!wait) return;
+            sched_yield();
+            continue;
+        }
+        emit_out(job->data, job->len);
+        if(job->pin != NULL) job->pin->jobs--;
+        pool->emitted++;
+    }
+}
+
+/**
+ * Writes bytes to the output, after the prints still being rendered by the readers.
+ * In a reader thread, the bytes go to the job it renders.
+ * While a print is captured the bytes go to its cache entry, until the cache runs out of bytes:
+ * then what was captured is written and the print goes on uncached.
+ * @param data (not null)
+ * @param len
+ */
+void emit(const char *data, size_t len) {
+    if(len == 0) return;
+    if(render != NULL) {
+        if(render->len + len > render->capacity) {
+            render->capacity = 2 * (render->len + len);
+            render->data = (char *) realloc(render->data, render->capacity);
+        }
+        memcpy(render->data + render->len, data, len);
+        render->len += len;
+        return;
+    }
+    if(readers != NULL && readers->emitted < atomic_load_explicit(&readers->published, memory_order_relaxed)) {
+        readers_collect(readers, true);
+    }
+    if(capture != NULL) {
+        print_entry_t *entry = capture;
+        size_t capacity = entry->capacity;
+        if(entry->len + len > capacity) {
+            capacity = 2 * (entry->len + len);
+            if(print_cache_bytes + capacity - entry->capacity > PRINT_CACHE_BYTES) {
+                capacity = entry->len + len;
+            }
+        }
+        if(print_cache_bytes + capacity - entry->capacity <= PRINT_CACHE_BYTES) {
+            if(capacity > entry->capacity) {
+                entry->data = (char *) realloc(entry->data, capacity);
+                print_cache_bytes += capacity - entry->capacity;
+                entry->capacity = capacity;
+            }
+            memcpy(entry->data + entry->len, data, len);
+            entry->len += len;
+            return;
+        }
+        capture = NULL;
+        emit(entry->data, entry->len);
+    }
+    emit_out(data, len);
+}
+
+/**
+ * Final mix of a rolling hash with the number of lines.
+ * @param sum the sum of hash * DIGEST_BASE^position over the lines
+ * @param size
+ * @return the digest of the version
+ */
+unsigned long long version_digest(unsigned long long sum, int size) {
+    // splitmix64 finalizer
+    unsigned long long h = sum ^ ((unsigned long long) size * 0xBF58476D1CE4E5B9ULL);
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+/**
+ * @param n
+ * @return DIGEST_BASE^n
+ */
+unsigned long long digest_power(int n) {
+    unsigned long long power = 1, base = DIGEST_BASE;
+    for(; n > 0; n >>= 1) {
+        if(n & 1) power *= base;
+        base *= base;
+    }
+    return power;
+}
+
+/**
+ * Prints the digest of a version as 16 hex digits.
+ * @param digest
+ */
+void print_digest(unsigned long long digest) {
+    char text[20];
+    emit(text, snprintf(text, sizeof(text), "%016llx\n", digest));
+}
+
+/**
+ * Sessions do not use the cache: a session can be suspended in the middle of emitting an entry
+ * that another session would then replace. Neither do reader threads, which share nothing with the editor loop.
+ * @return whether the print about to start can use the cache
+ */
+bool print_cache_usable() {
+    return print_cache_on && session == NULL && render == NULL;
+}
+
+/**
+ * @param count
+ * @return print_ids, with room for count ids
+ */
+unsigned int *print_ids_reserve(int count) {
+    if(count >= print_ids_capacity) {
+        print_ids_capacity = 2 * count + 1;
+        print_ids = (unsigned int *) realloc(print_ids, print_ids_capacity * sizeof(unsigned int));
+    }
+    return print_ids;
+}
+
+/**
+ * Starts a print: emits it from the cache on a hit, otherwise starts capturing it into its entry.
+ * Lines never change once read and every line read gets its own id, so the entry holds the output of
+ * this print if it has the same ids: the digest alone may collide.
+ * @param digest the digest of the version printed
+ * @param arg1
+ * @param arg2
+ * @param count the number of lines printed, whose ids are in print_ids
+ * @return true on a hit, when there is nothing left to print
+ */
+bool print_cache_begin(unsigned long long digest, int arg1, int arg2, int count) {
+    if(!print_cache_usable()) return false;
+    unsigned long long key = version_digest(digest ^ (unsigned int) arg1, arg2);
+    print_entry_t *entry = &print_cache[key & (PRINT_CACHE_SLOTS - 1)];
+    if(entry->valid && entry->digest == digest && entry->arg1 == arg1 && entry->arg2 == arg2 &&
+       entry->count == count && memcmp(entry->ids, print_ids, count * sizeof(unsigned int)) == 0) {
+        emit(entry->data, entry->len);
+        return true;
+    }
+    entry->valid = false;
+    if(count >= entry->ids_capacity) {
+        size_t grow = (count + 1 - entry->ids_capacity) * sizeof(unsigned int);
+        if(print_cache_bytes + grow > PRINT_CACHE_BYTES) return false;
+        entry->ids = (unsigned int *) realloc(entry->ids, (count + 1) * sizeof(unsigned int));
+        entry->ids_capacity = count + 1;
+        print_cache_bytes += grow;
+    }
+    memcpy(entry->ids, print_ids, count * sizeof(unsigned int));
+    entry->digest = digest;
+    entry->arg1 = arg1;
+    entry->arg2 = arg2;
+    entry->count = count;
+    entry->len = 0;
+    capture = entry;
+    return false;
+}
+
+/**
+ * Ends a print started by print_cache_begin, emitting it if it was captured whole.
+ */
+void print_cache_end() {
+    if(render != NULL || capture == NULL) return;
+    print_entry_t *entry = capture;
+    capture = NULL;
+    entry->valid = true;
+    emit(entry->data, entry->len);
+}
+
+long long journal_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * @param data (not null)
+ * @param pos
+ * @param len
+ * @return the length of the input line at pos, with its newline, 0 if it is cut short
+ */
+size_t replay_line_len(const char *data, size_t pos, size_t len) {
+    const char *end = (const char *) memchr(data + pos, '\n', len - pos);
+    return end != NULL ? (size_t) (end - (data + pos) + 1) : 0;
+}
+
+/**
+ * Finds the end of the last complete record of a journal: a crash may have cut the last group anywhere.
+ * @param data (not null)
+ * @param len
+ * @return
+ */
+size_t journal_scan(const char *data, size_t len) {
+    size_t pos = 0, valid = 0;
+    while(pos < len) {
+        const char *end = (const char *) memchr(data + pos, '\n', len - pos);
+        if(end == NULL) break;
+        char *next;
+        long arg1 = strtol(data + pos, &next, 10), arg2 = *next == ',' ? strtol(next + 1, NULL, 10) : 0;
+        char type = end > data + pos ? end[-1] : 0;
+        pos = end - data + 1;
+        if(type == 'c' || type == 'i') {
+            // the lines, then .\n
+            long i = 0;
+            for(size_t n; i <= arg2 - arg1 && (n = replay_line_len(data, pos, len)) > 0; i++) pos += n;
+            if(i <= arg2 - arg1 || len - pos < 2 || data[pos] != '.' || data[pos + 1] != '\n') break;
+            pos += 2;
+        }
+        valid = pos;
+    }
+    return valid;
+}
+
+/**
+ * Appends bytes to the records pending, with the lock held.
+ * @param log (not null)
+ * @param data (not null)
+ * @param len
+ */
+void journal_append(journal_t *log, const char *data, size_t len) {
+    if(log->len + len > log->capacity) {
+        log->capacity = 2 * (log->len + len);
+        log->buf = (char *) realloc(log->buf, log->capacity);
+    }
+    memcpy(log->buf + log->len, data, len);
+    log->len += len;
+}
+
+/**
+ * Writes the pending records and waits for them to reach the disk, with the lock held.
+ * @param log (not null)
+ */
+void journal_sync(journal_t *log) {
+    size_t done = 0;
+    while(done < log->len) {
+        ssize_t n = write(log->fd, log->buf + done, log->len - done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+        done += n;
+    }
+    if(log->len > 0) fdatasync(log->fd);
+    log->len = 0;
+    log->pending = 0;
+}
+
+/**
+ * Counts a record complete, with the lock held, waking the flusher for the deadline of a new group.
+ * @param log (not null)
+ */
+void journal_complete(journal_t *log) {
+    if(log->pending++ > 0) return;
+    log->first_pending = journal_clock();
+    pthread_cond_signal(&log->wake);
+}
+
+/**
+ * Runs the flusher thread: writes the pending group once its oldest record is sync_millis old.
+ * @param arg the journal (not null)
+ * @return
+ */
+void *journal_main(void *arg) {
+    journal_t *log = (journal_t *) arg;
+    pthread_mutex_lock(&log->lock);
+    while(!log->closing) {
+        if(log->pending == 0) {
+            pthread_cond_wait(&log->wake, &log->lock);
+            continue;
+        }
+        long long deadline = log->first_pending + log->sync_millis;
+        if(journal_clock() >= deadline) {
+            journal_sync(log);
+            continue;
+        }
+        struct timespec at = {deadline / 1000, deadline % 1000 * 1000000};
+        pthread_cond_timedwait(&log->wake, &log->lock, &at);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+/**
+ * Opens the journal, keeping what it holds to be read back first. A record cut by a crash is dropped.
+ * @param path (not null)
+ * @param sync_every
+ * @param sync_millis
+ * @return the journal, NULL if it cannot be opened
+ */
+journal_t *journal_open(const char *path, int sync_every, long long sync_millis) {
+    struct stat info;
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if(fd < 0 || fstat(fd, &info) < 0) {
+        perror(path);
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
+    journal_t *opened = (journal_t *) calloc(1, sizeof(journal_t));
+    opened->fd = fd;
+    opened->sync_every = sync_every < 1 ? 1 : sync_every;
+    opened->sync_millis = sync_millis;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&opened->lock, NULL);
+    pthread_cond_init(&opened->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    // without the flusher the deadline is checked as commands arrive
+    opened->timed = pthread_create(&opened->flusher, NULL, journal_main, opened) == 0;
+    if(info.st_size > 0) {
+        char *data = (char *) mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        size_t valid = data == MAP_FAILED ? 0 : journal_scan(data, info.st_size);
+        if(valid < (size_t) info.st_size && ftruncate(fd, valid) < 0) perror(path);
+        if(valid > 0) {
+            madvise(data, valid, MADV_SEQUENTIAL);
+            opened->replay = data;
+            opened->replay_len = valid;
+        } else if(data != MAP_FAILED) {
+            munmap(data, info.st_size);
+        }
+    }
+    return opened;
+}
+
+/**
+ * Records a command if it changes the history and was not read back from the journal.
+ * The header of a change or an insert is kept until read_content has read its lines, which complete the record.
+ * Called when the previous command is complete, which is when a full group is written.
+ * @param log (not null)
+ * @param command (not null)
+ */
+void journal_command(journal_t *log, cmd *command) {
+    char *header = log->header;
+    int len = 0;
+    const int *args = command->args;
+    log->recording = false;
+    if(log->replay != NULL) return;
+    pthread_mutex_lock(&log->lock);
+    if(log->pending >= log->sync_every || (!log->timed && log->pending > 0 && journal_clock() - log->first_pending >= log->sync_millis)) {
+        journal_sync(log);
+    }
+    pthread_mutex_unlock(&log->lock);
+    switch(command->type) {
+        case CHANGE:
+        case DELETE:
+        case INSERT:
+            len = snprintf(header, sizeof(log->header), "%d,%d%c\n", args[0], args[1], command->type == CHANGE ? 'c' : command->type == DELETE ? 'd' : 'i');
+            break;
+        case MOVE:
+        case COPY:
+            len = snprintf(header, sizeof(log->header), "%d,%d,%d%c\n", args[0], args[1], args[2], command->type == MOVE ? 'm' : 't');
+            break;
+        case UNDO:
+        case REDO:
+        case JUMP:
+            len = snprintf(header, sizeof(log->header), "%d%c\n", args[0], command->type == UNDO ? 'u' : command->type == REDO ? 'r' : 'j');
+            break;
+        case BEGIN:
+        case COMMIT:
+            len = snprintf(header, sizeof(log->header), "%c\n", command->type == BEGIN ? '{' : '}');
+            break;
+        default:
+            return;
+    }
+    log->recording = command->type == CHANGE || command->type == INSERT;
+    if(log->recording) {
+        log->header_len = len;
+        return;
+    }
+    pthread_mutex_lock(&log->lock);
+    journal_append(log, header, len);
+    journal_complete(log);
+    pthread_mutex_unlock(&log->lock);
+}
+
+/**
+ * Writes what is pending and closes the journal.
+ * @param log (not null)
+ */
+void journal_close(journal_t *log) {
+    pthread_mutex_lock(&log->lock);
+    log->closing = true;
+    pthread_cond_signal(&log->wake);
+    pthread_mutex_unlock(&log->lock);
+    if(log->timed) pthread_join(log->flusher, NULL);
+    journal_sync(log);
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->wake);
+    if(log->replay != NULL) munmap(log->replay, log->replay_len);
+    close(log->fd);
+    free(log->buf);
+    free(log);
+}
+
+/**
+ * Reads the next input character from the journal being read back (stdin once it is over), or from the
+ * connection of the running session. After the end of a connection the input is an endless "q\n":
+ * whatever the editor is reading, it quits.
+ * @return
+ */
+int next_char_slow() {
+    if(session == NULL) {
+        if(journal->replay_pos < journal->replay_len) return (unsigned char) journal->replay[journal->replay_pos++];
+        munmap(journal->replay, journal->replay_len);
+        journal->replay = NULL;
+        return getchar_unlocked();
+    }
+    while(session->in_pos == session->in_len) {
+        if(session->eof) return session->eof_chars++ % 2 == 0 ? 'q' : '\n';
+        // let the consumer catch up while waiting
+        out_pump(session->out, false);
+        session_wait(EPOLLIN);
+    }
+    return (unsigned char) session->in[session->in_pos++];
+}
+
+/**
+ * Reads the next input character, from stdin or from the connection of the running session.
+ * The journal being read back comes before stdin.
+ * @return
+ */
+int next_char() {
+    // stdin alone is kept small enough to be inlined into the parser
+    if(session == NULL && (journal == NULL || journal->replay == NULL)) return getchar_unlocked();
+    return next_char_slow();
+}
+
+void print_line(const line_t *line) {
+    emit(line_text(line), line->len);
+}
+
+/**
+ * Reads the next input line, whatever its length, into a descriptor. stdin is read by getline into a buffer
+ * kept between calls: a line of at least LINE_ADOPT_MIN bytes takes that buffer over as its text, so however
+ * long it is, it is never copied once read; shorter lines are copied out of it (inline, or in a buffer of their size).
+ * @return
+ */
+line_t read_line() {
+    static char *scratch = NULL;
+    static size_t capacity = 0;
+    char *text = NULL;
+    size_t len = 0, size = 0;
+    int c = 0;
+    if(session == NULL && journal != NULL && journal->replay != NULL && journal->replay_pos < journal->replay_len) {
+        // straight from the mapping of the journal
+        size_t n = replay_line_len(journal->replay, journal->replay_pos, journal->replay_len);
+        line_t line = make_line(journal->replay + journal->replay_pos, n);
+        journal->replay_pos += n;
+        return line;
+    }
+    if(session == NULL) {
+        ssize_t n = getline(&scratch, &capacity, stdin);
+        // the input ended inside a change: an empty line rather than a slot without a line
+        if(n <= 0) return make_line("\n", 1);
+        if(n < LINE_ADOPT_MIN) return make_line(scratch, n);
+        text = scratch;
+        scratch = NULL;
+        capacity = 0;
+        return adopt_line(text, n);
+    }
+    // a session may be suspended in the middle of a line, which has a buffer of its own
+    while(c != '\n') {
+        c = next_char();
+        if(len == size) {
+            size = size == 0 ? 2 * LINE_INLINE_MAX : 2 * size;
+            text = (char *) realloc(text, size);
+        }
+        text[len++] = (char) c;
+    }
+    if(len >= LINE_ADOPT_MIN) return adopt_line(text, len);
+    line_t line = make_line(text, len);
+    free(text);
+    return line;
+}
+
+chunk_pool_t chunk_pool = {PTHREAD_MUTEX_INITIALIZER, {NULL, 0, 0}, 0, NULL};
+
+/**
+ * @param text at least 3 bytes (not null)
+ * @return the bit of the trigram starting at text in a signature
+ */
+unsigned int trigram_bit(const unsigned char *text) {
+    unsigned int trigram = (unsigned int) text[0] << 16 | (unsigned int) text[1] << 8 | text[2];
+    return (trigram * 0x9E3779B1U) >> (32 - SEARCH_BLOOM_LOG);
+}
+
+/**
+ * @param line (not null)
+ * @return the length of the line without its newline
+ */
+int line_content_len(const line_t *line) {
+    return line->len > 0 && line_text(line)[line->len - 1] == '\n' ? line->len - 1 : line->len;
+}
+
+/**
+ * Commits the signatures of the blocks of all the ids handed out so far.
+ * @return the signatures, NULL if the index failed
+ */
+unsigned long long *search_index_reserve() {
+    size_t blocks = (size_t) (search_index.next_id >> SEARCH_BLOCK_SHIFT) + 1;
+    if(search_index.failed) return NULL;
+    void *blooms = region_commit(&search_index.region, blocks * SEARCH_BLOOM_WORDS * sizeof(unsigned long long), true);
+    if(blooms == NULL) search_index.failed = true;
+    return (unsigned long long *) blooms;
+}
+
+/**
+ * Adds the trigrams of the text of a line to the signature of its block.
+ * @param blooms the signatures, reserved after the line was read (not null)
+ * @param id
+ * @param text (not null)
+ * @param len the length of the text, without its newline
+ */
+void search_index_text(unsigned long long *blooms, unsigned int id, const unsigned char *text, int len) {
+    unsigned long long *bloom = blooms + (size_t) (id >> SEARCH_BLOCK_SHIFT) * SEARCH_BLOOM_WORDS;
+    for(int j = 0; j + 2 < len; j++) {
+        unsigned int bit = trigram_bit(text + j);
+        bloom[bit >> 6] |= 1ULL << (bit & 63);
+    }
+}
+
+/**
+ * Adds the trigrams of a line to the signature of its block.
+ * @param blooms the signatures, reserved after the line was read (not null)
+ * @param line (not null)
+ */
+void search_index_line(unsigned long long *blooms, const line_t *line) {
+    search_index_text(blooms, line->id, (const unsigned char *) line_text(line), line_content_len(line));
+}
+
+/**
+ * Adds the lines of a change to the signatures. Packed lines are read from their block, which stays packed.
+ * @param blooms the signatures, reserved after the lines were read (not null)
+ * @param lines (not null)
+ * @param count
+ */
+void search_index_lines(unsigned long long *blooms, const line_t *lines, int count) {
+    uintptr_t packed = 0;
+    for(int i = 0; i < count && packed == 0; i++) {
+        if(lines[i].len > LINE_INLINE_MAX && (line_entry(&lines[i]) & 1)) packed = line_entry(&lines[i]);
+    }
+    if(packed == 0) {
+        for(int i = 0; i < count; i++) search_index_line(blooms, &lines[i]);
+        return;
+    }
+    unsigned char *text = cold_unpack((cold_block_t *) (packed - 1));
+    for(int i = 0, at = 0; i < count; i++) {
+        if(lines[i].len <= LINE_INLINE_MAX) {
+            search_index_line(blooms, &lines[i]);
+            continue;
+        }
+        int len = text[at + lines[i].len - 1] == '\n' ? lines[i].len - 1 : lines[i].len;
+        search_index_text(blooms, lines[i].id, text + at, len);
+        at += lines[i].len;
+    }
+    free(text);
+}
+
+/**
+ * Finds the blocks of lines that may contain a pattern: those whose signature has every trigram of it.
+ * @param pattern (not null)
+ * @param len
+ * @return a bitmap over the blocks of all the ids handed out so far (to free)
+ */
+unsigned long long *search_candidates(const char *pattern, int len) {
+    size_t blocks = (size_t) (search_index.next_id >> SEARCH_BLOCK_SHIFT) + 1;
+    unsigned long long *candidates = (unsigned long long *) malloc((blocks + 63) / 64 * sizeof(unsigned long long));
+    const unsigned long long *blooms = search_index_reserve();
+    memset(candidates, 0xFF, (blocks + 63) / 64 * sizeof(unsigned long long));
+    if(len < 3 || blooms == NULL) return candidates;
+    for(size_t b = 0; b < blocks; b++) {
+        const unsigned long long *bloom = blooms + b * SEARCH_BLOOM_WORDS;
+        for(int j = 0; j + 2 < len; j++) {
+            unsigned int bit = trigram_bit((const unsigned char *) pattern + j);
+            if((bloom[bit >> 6] >> (bit & 63) & 1) == 0) {
+                candidates[b >> 6] &= ~(1ULL << (b & 63));
+                break;
+            }
+        }
+    }
+    return candidates;
+}
+
+/**
+ * @param line (not null)
+ * @param pattern (not null)
+ * @param len
+ * @param candidates the blocks that may contain the pattern (not null)
+ * @return true if the text of the line contains the pattern, read only if its block is a candidate
+ */
+bool line_matches(const line_t *line, const char *pattern, int len, const unsigned long long *candidates) {
+    unsigned int block = line->id >> SEARCH_BLOCK_SHIFT;
+    if((candidates[block >> 6] >> (block & 63) & 1) == 0) return false;
+    return memmem(line_text(line), line_content_len(line), pattern, len) != NULL;
+}
+
+/**
+ * Prints a match of a search: the position of the line and the version that wrote it.
+ * @param position 1 based
+ * @param version
+ */
+void print_match(int position, int version) {
+    char text[32];
+    emit(text, snprintf(text, sizeof(text), "%d %d\n", position, version));
+}
+
+/**
+ * Reserves the chunk pool: as much address space as the system gives, up to CHUNK_POOL_RESERVE,
+ * aligned on huge pages.
+ * @param pool (not null)
+ */
+void chunk_pool_reserve(chunk_pool_t *pool) {
+    for(size_t reserved = CHUNK_POOL_RESERVE; reserved >= CHUNK_POOL_MIN; reserved /= 2) {
+        char *base = (char *) mmap(NULL, reserved + HUGE_PAGE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(base == MAP_FAILED) continue;
+        char *aligned = (char *) (((unsigned long) base + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+        if(aligned > base) munmap(base, aligned - base);
+        munmap(aligned + reserved, base + HUGE_PAGE - aligned);
+        madvise(aligned, reserved, MADV_HUGEPAGE);
+        pool->region.base = aligned;
+        pool->region.reserved = reserved;
+        return;
+    }
+    // no address space to reserve: chunks come from malloc
+    pool->region.reserved = 1;
+}
+
+/**
+ * @return a new chunk, from malloc or, with huge pages, from the free list, the pool or (when the pool is full) malloc
+ */
+chunk_t *chunk_alloc() {
+    chunk_pool_t *pool = &chunk_pool;
+    chunk_t *chunk = NULL;
+    // the pool is there for huge pages: without them reserving it costs more than malloc
+    if(!huge_pages) return (chunk_t *) malloc(sizeof(chunk_t));
+    pthread_mutex_lock(&pool->lock);
+    if(pool->region.reserved == 0) chunk_pool_reserve(pool);
+    if(pool->free_list != NULL) {
+        chunk = pool->free_list;
+        memcpy(&pool->free_list, chunk->lines, sizeof(chunk_t *));
+    } else if(pool->region.base != NULL && pool->used + sizeof(chunk_t) <= pool->region.reserved) {
+        if(pool->used + sizeof(chunk_t) > pool->region.committed) {
+            // commit whole huge pages
+            size_t commit = pool->region.committed + HUGE_PAGE;
+            if(mprotect(pool->region.base + pool->region.committed, HUGE_PAGE, PROT_READ | PROT_WRITE) == 0) {
+                pool->region.committed = commit;
+            }
+        }
+        if(pool->used + sizeof(chunk_t) <= pool->region.committed) {
+            chunk = (chunk_t *) (pool->region.base + pool->used);
+            pool->used += sizeof(chunk_t);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return chunk != NULL ? chunk : (chunk_t *) malloc(sizeof(chunk_t));
+}
+
+void chunk_free(chunk_t *chunk) {
+    chunk_pool_t *pool = &chunk_pool;
+    char *address = (char *) chunk;
+    if(address < pool->region.base || address >= pool->region.base + pool->region.reserved) {
+        free(chunk);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    memcpy(chunk->lines, &pool->free_list, sizeof(chunk_t *));
+    pool->free_list = chunk;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int chunk_count(int size) {
+    return (size + CHUNK_LINES - 1) >> CHUNK_SHIFT;
+}
+
+line_t *get_line(snapshot_t *document, int i) {
+    return &document->chunks[i >> CHUNK_SHIFT]->lines[i & CHUNK_MASK];
+}
+
+void release_chunk(chunk_t *chunk) {
+    if(chunk != NULL && --chunk->refs == 0) chunk_free(chunk);
+}
+
+/**
+ * Makes room for count chunk slots, new slots are empty.
+ * @param document (not null)
+ * @param count
+ */
+void reserve_chunks(snapshot_t *document, int count) {
+    if(count <= document->capacity) return;
+    // a growing document doubles its table, a new one gets what it needs
+    int capacity = count + CAPACITY_CONST;
+    if(capacity < 2 * document->capacity) capacity = 2 * document->capacity;
+    document->chunks = (chunk_t **) realloc(document->chunks, capacity * sizeof(chunk_t *));
+    document->hashes = (unsigned long long *) realloc(document->hashes, capacity * sizeof(unsigned long long));
+    for(int i = document->capacity; i < capacity; i++) {
+        document->chunks[i] = NULL;
+        document->hashes[i] = 0;
+    }
+    document->capacity = capacity;
+}
+
+/**
+ * Releases the chunks from index from onwards.
+ * @param document (not null)
+ * @param from
+ */
+void release_chunks(snapshot_t *document, int from) {
+    for(int i = from; i < chunk_count(document->size); i++) {
+        release_chunk(document->chunks[i]);
+        document->chunks[i] = NULL;
+        if(i < document->stale) document->digest -= document->hashes[i];
+        document->hashes[i] = 0;
+    }
+}
+
+/**
+ * Gets a chunk of the editor that can be written, copying it first if it is shared.
+ * Only the lines in use are copied.
+ * @param editor (not null)
+ * @param index the chunk index (< editor->capacity)
+ * @return the lines of the chunk
+ */
+line_t *write_chunk(snapshot_t *editor, int index) {
+    chunk_t *chunk = editor->chunks[index];
+    if(chunk == NULL || chunk->refs > 1) {
+        editor->chunks[index] = chunk_alloc();
+        editor->chunks[index]->refs = 1;
+        if(chunk != NULL) {
+            int used = editor->size - (index << CHUNK_SHIFT);
+            if(used > CHUNK_LINES) used = CHUNK_LINES;
+            if(used > 0) memcpy(editor->chunks[index]->lines, chunk->lines, used * sizeof(line_t));
+            chunk->refs--;
+        }
+    }
+    return editor->chunks[index]->lines;
+}
+
+/**
+ * Makes the chunk hashes from chunk from onwards stale.
+ * @param document (not null)
+ * @param from
+ */
+void stale_hashes(snapshot_t *document, int from) {
+    for(int i = from; i < document->stale && i < chunk_count(document->size); i++) {
+        document->digest -= document->hashes[i];
+    }
+    if(from < document->stale) document->stale = from;
+}
+
+/**
+ * Hashes the stale chunks of a document again.
+ * @param document (not null)
+ * @return the digest of the document
+ */
+unsigned long long document_digest(snapshot_t *document) {
+    int count = chunk_count(document->size);
+    if(document->stale < count) {
+        unsigned long long power = digest_power(document->stale << CHUNK_SHIFT);
+        for(int c = document->stale; c < count; c++) {
+            int used = document->size - (c << CHUNK_SHIFT);
+            unsigned long long hash = 0;
+            if(used > CHUNK_LINES) used = CHUNK_LINES;
+            for(int i = 0; i < used; i++) {
+                hash += line_digest(&document->chunks[c]->lines[i]) * power;
+                power *= DIGEST_BASE;
+            }
+            document->hashes[c] = hash;
+            document->digest += hash;
+        }
+    }
+    document->stale = INT_MAX;
+    return version_digest(document->digest, document->size);
+}
+
+/**
+ * Writes count lines into the editor starting at position at (0 based), without growing it:
+ * the chunk slots must already be there and the size is not updated.
+ * The hashes of the chunks that are not stale are updated, hashing the lines that were not yet (so replay threads
+ * only write stale chunks), the digest is left to the caller (replay threads write concurrently).
+ * @param editor (not null)
+ * @param at
+ * @param lines (not null)
+ * @param count
+ * @return the change of the digest
+ */
+unsigned long long write_span(snapshot_t *editor, int at, const line_t *lines, int count) {
+    unsigned long long start, power, delta = 0, chunk_delta;
+    int n;
+    line_t *to;
+    while(count > 0) {
+        n = CHUNK_LINES - (at & CHUNK_MASK);
+        if(n > count) n = count;
+        to = write_chunk(editor, at >> CHUNK_SHIFT) + (at & CHUNK_MASK);
+        if((at >> CHUNK_SHIFT) < editor->stale) {
+            start = power = digest_power(at);
+            chunk_delta = 0;
+            // slots past the end hold old lines, not counted in the hash
+            for(int i = 0; i < n && at + i < editor->size; i++) {
+                chunk_delta -= line_digest(&to[i]) * power;
+                power *= DIGEST_BASE;
+            }
+            // the lines are hashed in the chunk, the ones given stay as they are
+            memcpy(to, lines, n * sizeof(line_t));
+            power = start;
+            for(int i = 0; i < n; i++) {
+                chunk_delta += line_digest(&to[i]) * power;
+                power *= DIGEST_BASE;
+            }
+            editor->hashes[at >> CHUNK_SHIFT] += chunk_delta;
+            delta += chunk_delta;
+        } else {
+            memcpy(to, lines, n * sizeof(line_t));
+        }
+        at += n;
+        lines += n;
+        count -= n;
+    }
+    return delta;
+}
+
+/**
+ * Writes count lines into the editor starting at position at (0 based), growing it if needed.
+ * @param editor (not null)
+ * @param at
+ * @param lines (not null)
+ * @param count
+ */
+void write_lines(snapshot_t *editor, int at, const line_t *lines, int count) {
+    reserve_chunks(editor, chunk_count(at + count));
+    editor->digest += write_span(editor, at, lines, count);
+    if(at + count > editor->size) editor->size = at + count;
+}
+
+/**
+ * Moves count lines of the editor from position src to position dst < src (0 based).
+ * @param editor (not null)
+ * @param dst
+ * @param src
+ * @param count
+ */
+void move_lines(snapshot_t *editor, int dst, int src, int count) {
+    int n;
+    line_t *to;
+    while(count > 0) {
+        n = CHUNK_LINES - (dst & CHUNK_MASK);
+        if(n > CHUNK_LINES - (src & CHUNK_MASK)) n = CHUNK_LINES - (src & CHUNK_MASK);
+        if(n > count) n = count;
+        // write_chunk may replace the chunk src points into
+        to = write_chunk(editor, dst >> CHUNK_SHIFT) + (dst & CHUNK_MASK);
+        memmove(to, get_line(editor, src), n * sizeof(line_t));
+        dst += n;
+        src += n;
+        count -= n;
+    }
+}
+
+/**
+ * Moves count lines of the editor from position src to position dst > src (0 based), from the last one,
+ * without growing it: the chunk slots must already be there.
+ * @param editor (not null)
+ * @param dst
+ * @param src
+ * @param count
+ */
+void move_lines_back(snapshot_t *editor, int dst, int src, int count) {
+    int n;
+    line_t *to;
+    while(count > 0) {
+        // the last n lines, within a chunk at both ends
+        n = ((dst + count - 1) & CHUNK_MASK) + 1;
+        if(n > ((src + count - 1) & CHUNK_MASK) + 1) n = ((src + count - 1) & CHUNK_MASK) + 1;
+        if(n > count) n = count;
+        count -= n;
+        to = write_chunk(editor, (dst + count) >> CHUNK_SHIFT) + ((dst + count) & CHUNK_MASK);
+        memmove(to, get_line(editor, src + count), n * sizeof(line_t));
+    }
+}
+
+/**
+ * Copies count lines of a document starting at position at (0 based).
+ * @param document (not null)
+ * @param at
+ * @param count
+ * @param out (not null, count long)
+ */
+void read_span(snapshot_t *document, int at, int count, line_t *out) {
+    while(count > 0) {
+        int n = CHUNK_LINES - (at & CHUNK_MASK);
+        if(n > count) n = count;
+        memcpy(out, get_line(document, at), n * sizeof(line_t));
+        at += n;
+        out += n;
+        count -= n;
+    }
+}
+
+/**
+ * Makes dest share all the chunks of source. dest must not hold any chunk.
+ * @param source (not null)
+ * @param dest (not null)
+ */
+void share_chunks(snapshot_t *source, snapshot_t *dest) {
+    int count = chunk_count(source->size);
+    reserve_chunks(dest, count);
+    for(int i = 0; i < count; i++) {
+        dest->chunks[i] = source->chunks[i];
+        dest->chunks[i]->refs++;
+    }
+    if(count > 0) memcpy(dest->hashes, source->hashes, count * sizeof(unsigned long long));
+    dest->digest = source->digest;
+    dest->stale = source->stale;
+    dest->size = source->size;
+}
+
+/**
+ * create a new snapshot with editor content. The snapshot shares the editor's chunks,
+ * so this costs one pointer per chunk.
+ * @param editor the main editor (not null)
+ * @param dest where to copy the editor (not null)
+ */
+void copy_editor(snapshot_t *editor, snapshot_t *dest) {
+    dest->chunks = NULL;
+    dest->hashes = NULL;
+    dest->capacity = 0;
+    share_chunks(editor, dest);
+}
+
+/**
+ * Makes the editor a view of dest: the editor's chunks are released and dest's ones are shared,
+ * so nothing is copied until the editor writes a line.
+ * @param editor (not null)
+ * @param dest (not null)
+ */
+void pass_to_snapshot(snapshot_t *editor, snapshot_t *dest) {
+    release_chunks(editor, 0);
+    share_chunks(dest, editor);
+    editor->index = dest->index;
+}
+
+/**
+ * Gets the target snapshot to return to.
+ * @param snapshots (not null)
+ * @param snap_size
+ * @param target_command
+ * @return the index of the snapshot to return to
+ */
+int backward_search_snapshot(snapshot_t **snapshots, int snap_size, int target_command) {
+    if(target_command >= snapshots[snap_size]->index) return snap_size;
+    for(int i = snap_size; i > 0; i--) {
+        if(target_command >= snapshots[i - 1]->index && target_command < snapshots[i]->index) {
+            return i - 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Prints count lines made of a single '.', a block of them at a time.
+ * @param count
+ */
+void print_dots(int count) {
+    static char block[2 * DOTS_BLOCK];
+    if(block[0] == 0) {
+        for(int i = 0; i < DOTS_BLOCK; i++) {
+            block[2 * i] = '.';
+            block[2 * i + 1] = '\n';
+        }
+    }
+    while(count > DOTS_BLOCK) {
+        emit(block, 2 * DOTS_BLOCK);
+        count -= DOTS_BLOCK;
+    }
+    if(count > 0) emit(block, 2 * count);
+}
+
+/**
+ * Handles print. The range is clamped to the lines that exist, the missing ones are printed
+ * as '.\n' in bulk, so the cost depends on the document size and not on the range width.
+ * As before, a range starting before the first line only prints '.\n'.
+ * The same range of a version with the same digest is printed again from the cache.
+ * @param editor (not null)
+ * @param arg1
+ * @param arg2
+ */
+void handle_print(snapshot_t *editor, int arg1, int arg2) {
+    if(print_cache_usable()) {
+        int count = arg1 > 0 && arg1 <= editor->size ? (arg2 > editor->size ? editor->size : arg2) - arg1 + 1 : 0;
+        unsigned int *ids = print_ids_reserve(count);
+        for(int i = 0; i < count; i++) ids[i] = get_line(editor, arg1 - 1 + i)->id;
+        if(print_cache_begin(document_digest(editor), arg1, arg2, count)) return;
+    }
+    int dots = arg2 - arg1 + 1;
+    if(arg1 > 0 && arg1 <= editor->size) {
+        int to = arg2 > editor->size ? editor->size : arg2;
+        for(int i = arg1 - 1; i < to; i++) {
+            print_line(get_line(editor, i));
+        }
+        dots -= to - arg1 + 1;
+    }
+    print_dots(dots);
+    print_cache_end();
+}
+
+/**
+ * Reads the lines of a change or an insert, and the '.' after them.
+ * @param count
+ * @return the lines (to free)
+ */
+line_t *read_content(int count) {
+    line_t *lines = (line_t *) malloc((count > 0 ? count : 1) * sizeof(line_t));
+    for(int i = 0; i < count; i++) {
+        lines[i] = read_line();
+    }
+    // .\n
+    next_char();
+    next_char();
+    if(journal != NULL && journal->recording) {
+        pthread_mutex_lock(&journal->lock);
+        journal_append(journal, journal->header, journal->header_len);
+        for(int i = 0; i < count; i++) journal_append(journal, line_text(&lines[i]), lines[i].len);
+        journal_append(journal, ".\n", 2);
+        journal_complete(journal);
+        pthread_mutex_unlock(&journal->lock);
+        journal->recording = false;
+    }
+    return lines;
+}
+
+/**
+ * Handle a change command. Put all new lines where they belong inside the editor.
+ * @param editor (not null)
+ * @param command (not null)
+ */
+void handle_change(snapshot_t *editor, command_t *command) {
+    int arg2 = command->arg2;
+    int arg1 = command->arg1;
+
+    command->content_lines = read_content(arg2 - arg1 + 1);
+    write_lines(editor, arg1 - 1, command->content_lines, arg2 - arg1 + 1);
+}
+
+/**
+ * Redo a change. Puts all the lines that have been inserted by the command back where they belong.
+ * @param editor (not null)
+ * @param command (not null)
+ */
+void redo_change(snapshot_t *editor, command_t *command) {
+    write_lines(editor, command->arg1 - 1, command->content_lines, command->arg2 - command->arg1 + 1);
+}
+
+/**
+ * Appends a node to the index arena.
+ * @param commandWrap (not null)
+ * @param tag
+ * @param left
+ * @param right
+ * @return the index of the new node
+ */
+int index_new_node(command_wrap_t *commandWrap, int tag, int left, int right) {
+    if(commandWrap->node_size >= commandWrap->node_capacity) {
+        commandWrap->node_capacity *= 2;
+        commandWrap->nodes = (index_node_t *) region_commit(&commandWrap->node_region, commandWrap->node_capacity * sizeof(index_node_t), true);
+    }
+    index_node_t *node = &commandWrap->nodes[commandWrap->node_size];
+    node->tag = tag;
+    node->left = left;
+    node->right = right;
+    node->max = tag;
+    if(commandWrap->nodes[left].max > node->max) node->max = commandWrap->nodes[left].max;
+    if(commandWrap->nodes[right].max > node->max) node->max = commandWrap->nodes[right].max;
+    return commandWrap->node_size++;
+}
+
+/**
+ * Marks the lines in [from, to) as written by tag, copying the nodes on the way (the old version stays valid).
+ * @param commandWrap (not null)
+ * @param node root of the subtree covering [lo, hi)
+ * @param lo
+ * @param hi
+ * @param from
+ * @param to
+ * @param tag larger than every tag already in the tree
+ * @return the new root of the subtree
+ */
+int index_assign(command_wrap_t *commandWrap, int node, int lo, int hi, int from, int to, int tag) {
+    if(to <= lo || hi <= from) return node;
+    index_node_t old = commandWrap->nodes[node];
+    if(from <= lo && hi <= to) return index_new_node(commandWrap, tag, old.left, old.right);
+    int mid = lo + (hi - lo) / 2;
+    int left = index_assign(commandWrap, old.left, lo, mid, from, to, tag);
+    int right = index_assign(commandWrap, old.right, mid, hi, from, to, tag);
+    return index_new_node(commandWrap, old.tag, left, right);
+}
+
+/**
+ * Adds the change at position i to the last writer index.
+ * @param commandWrap (not null)
+ * @param i
+ * @param seg_start the index of the first change after the last snapshot
+ */
+void index_change(command_wrap_t *commandWrap, int i, int seg_start) {
+    command_t *command = commandWrap->commands[i];
+    int root = 0, bits = 0;
+    if(i > seg_start) {
+        root = commandWrap->commands[i - 1]->index_root;
+        bits = commandWrap->commands[i - 1]->index_bits;
+    }
+    command->index_mark = commandWrap->node_size;
+    // grow the covered range, the old tree becomes the left half
+    while(bits < MAX_INDEX_BITS && (1 << bits) < command->arg2) {
+        if(root != 0) root = index_new_node(commandWrap, 0, root, 0);
+        bits++;
+    }
+    command->index_root = index_assign(commandWrap, root, 0, 1 << bits, command->arg1 - 1, command->arg2, i + 1);
+    command->index_bits = bits;
+    command->width_sum = (i > 0 ? commandWrap->commands[i - 1]->width_sum : 0) + command->arg2 - command->arg1 + 1;
+}
+
+/**
+ * Adds the changes not indexed yet to the last writer index, in order, up to change last (excluded).
+ * @param commandWrap (not null)
+ * @param last
+ */
+void index_changes(command_wrap_t *commandWrap, int last) {
+    for(; commandWrap->index_end < last; commandWrap->index_end++) {
+        index_change(commandWrap, commandWrap->index_end, commandWrap->commands[commandWrap->index_end]->segment);
+    }
+}
+
+/**
+ * @param commandWrap (not null)
+ * @param node root of the subtree covering [lo, hi)
+ * @param lo
+ * @param hi
+ * @return the end of the last line written in the subtree, 0 if none
+ */
+int index_extent(command_wrap_t *commandWrap, int node, int lo, int hi) {
+    while(node != 0 && commandWrap->nodes[node].tag == 0) {
+        int mid = lo + (hi - lo) / 2;
+        if(commandWrap->nodes[node].right != 0) {
+            node = commandWrap->nodes[node].right;
+            lo = mid;
+        } else {
+            node = commandWrap->nodes[node].left;
+            hi = mid;
+        }
+    }
+    return node == 0 ? 0 : hi;
+}
+
+/**
+ * Writes the lines of a job, each one exactly once, taking it from the change that wrote it last.
+ * Subtrees with no tag newer than job->after are skipped, runs of lines with the same last writer
+ * are copied at once.
+ * @param job (not null)
+ * @param node root of the subtree covering [lo, hi)
+ * @param lo
+ * @param hi
+ * @param inherited the largest tag on the path above node
+ */
+void index_replay(replay_job_t *job, int node, int lo, int hi, int inherited) {
+    index_node_t *nodes = job->commandWrap->nodes;
+    if(hi <= job->from || job->to <= lo) return;
+    int tag = nodes[node].tag > inherited ? nodes[node].tag : inherited;
+    if(nodes[node].max <= tag) {
+        // the whole range has the same last writer
+        if(tag <= job->after) return;
+        command_t *command = job->commandWrap->commands[tag - 1];
+        int from = lo > job->from ? lo : job->from;
+        int to = hi < job->to ? hi : job->to;
+        job->digest += write_span(job->editor, from, command->content_lines + from - command->arg1 + 1, to - from);
+        return;
+    }
+    int mid = lo + (hi - lo) / 2;
+    index_replay(job, nodes[node].left, lo, mid, tag);
+    index_replay(job, nodes[node].right, mid, hi, tag);
+}
+
+/**
+ * @param commandWrap (not null)
+ * @param first
+ * @param last
+ * @return the lines written by the changes in [first, last)
+ */
+long long replay_width(command_wrap_t *commandWrap, int first, int last) {
+    if(last <= first) return 0;
+    return commandWrap->commands[last - 1]->width_sum - (first > 0 ? commandWrap->commands[first - 1]->width_sum : 0);
+}
+
+void *replay_range(void *arg) {
+    replay_job_t *job = (replay_job_t *) arg;
+    index_replay(job, job->root, 0, 1 << job->bits, 0);
+    return NULL;
+}
+
+/**
+ * Brings the editor from the version after change first - 1 to the version after change last - 1 of the
+ * same segment (no snapshot in between), writing only the lines changed in between, each one once
+ * (or redoing them in order, when that writes fewer lines than the index walk visits).
+ * A large replay is split by line ranges (whole chunks, so no chunk is shared between threads)
+ * and every thread writes its own range.
+ * @param editor (not null)
+ * @param commandWrap (not null)
+ * @param first
+ * @param last
+ * @param threads the most threads to use
+ */
+void replay_changes(snapshot_t *editor, command_wrap_t *commandWrap, int first, int last, int threads) {
+    pthread_t workers[MAX_REPLAY_THREADS];
+    replay_job_t jobs[MAX_REPLAY_THREADS];
+    if(last <= first) return;
+    index_changes(commandWrap, last);
+    // walking the index visits at most two nodes per node the changes added: cheaper to just redo narrow changes
+    int nodes = (last < commandWrap->index_end ? commandWrap->commands[last]->index_mark : commandWrap->node_size)
+            - commandWrap->commands[first]->index_mark;
+    if(replay_width(commandWrap, first, last) <= 2LL * nodes) {
+        for(int i = first; i < last; i++) redo_change(editor, commandWrap->commands[i]);
+        return;
+    }
+    int root = commandWrap->commands[last - 1]->index_root;
+    int bits = commandWrap->commands[last - 1]->index_bits;
+    int size = index_extent(commandWrap, root, 0, 1 << bits);
+
+    if(size < editor->size) size = editor->size;
+    reserve_chunks(editor, chunk_count(size));
+    if(threads > MAX_REPLAY_THREADS) threads = MAX_REPLAY_THREADS;
+    if(threads > chunk_count(size)) threads = chunk_count(size);
+    if(size < PARALLEL_REPLAY_MIN || threads < 1) threads = 1;
+    // threads may not hash lines (reading a packed one unpacks it): the chunks they write are stale
+    if(threads > 1) stale_hashes(editor, 0);
+    for(int t = 0; t < threads; t++) {
+        jobs[t].editor = editor;
+        jobs[t].commandWrap = commandWrap;
+        jobs[t].root = root;
+        jobs[t].bits = bits;
+        jobs[t].after = first;
+        jobs[t].from = (int) ((long long) chunk_count(size) * t / threads) << CHUNK_SHIFT;
+        jobs[t].to = (int) ((long long) chunk_count(size) * (t + 1) / threads) << CHUNK_SHIFT;
+        jobs[t].digest = 0;
+        if(t > 0 && pthread_create(&workers[t], NULL, replay_range, &jobs[t]) != 0) {
+            // no thread available, do it here
+            replay_range(&jobs[t]);
+            workers[t] = 0;
+        }
+    }
+    replay_range(&jobs[0]);
+    for(int t = 1; t < threads; t++) {
+        if(workers[t] != 0) pthread_join(workers[t], NULL);
+    }
+    for(int t = 0; t < threads; t++) editor->digest += jobs[t].digest;
+    editor->size = size;
+}
+
+/**
+ * Moves a fixed point average towards an integer sample.
+ * @param average (not null)
+ * @param sample
+ */
+void ewma(long long *average, long long sample) {
+    *average += ((sample << FIXED_SHIFT) - *average) >> EWMA_SHIFT;
+}
+
+void cost_change(cost_model_t *model, int width) {
+    ewma(&model->change_width, width);
+    model->changes++;
+}
+
+/**
+ * Records a restore.
+ * @param model (not null)
+ * @param depth snapshots between the current one and the restored one
+ */
+void cost_restore(cost_model_t *model, int depth) {
+    ewma(&model->undo_depth, depth + 1);
+    model->restores++;
+}
+
+/**
+ * Expected cost of a full snapshot of size lines: the chunk table, plus the lines the editor will copy out
+ * of the shared chunks before the next delete (the expected changes, half the document for the next shift).
+ * @param model (not null)
+ * @param size
+ * @return the cost in lines written
+ */
+long long snapshot_cost(cost_model_t *model, int size) {
+    long long width = (model->change_width >> FIXED_SHIFT) + CHUNK_LINES;
+    long long copies = ((model->segment_changes * width) >> FIXED_SHIFT) + (model->doc_size >> FIXED_SHIFT) / 2;
+    if(copies > size) copies = size;
+    return chunk_count(size) + copies;
+}
+
+/**
+ * Decides how to store the snapshot of a delete. A snapshot stays reachable by restores for about undo_depth
+ * deletes, so restore_rate * undo_depth restores are expected to rebuild it if it is a delta: the delta is kept
+ * while that costs less than a full snapshot, and while rebuilding it costs less than DELTA_CHAIN_MAX full ones.
+ * @param model (not null)
+ * @param chain the cost of rebuilding the snapshot
+ * @param size the lines of the snapshot
+ * @return true to keep a full snapshot
+ */
+bool keep_snapshot(cost_model_t *model, long long chain, int size) {
+    if(!model->adaptive) return true;
+    long long cost = snapshot_cost(model, size);
+    long long rate = (model->restore_rate * model->undo_depth) >> FIXED_SHIFT;
+    if(chain >= DELTA_CHAIN_MAX * cost) return true;
+    return rate > 0 && chain >= (cost << FIXED_SHIFT) / rate;
+}
+
+/**
+ * Deletes the lines in [arg1, arg2] that exist.
+ * @param editor (not null)
+ * @param arg1
+ * @param arg2
+ * @return the lines moved
+ */
+int delete_lines(snapshot_t *editor, int arg1, int arg2) {
+    int from = arg1 <= 0 ? 1 : arg1;
+    int to = arg2 > editor->size ? editor->size : arg2;
+    int delta = to - from + 1;
+    if(delta <= 0) return 0;
+    // shift lines after the deleted ones, all their positions change
+    stale_hashes(editor, (from - 1) >> CHUNK_SHIFT);
+    move_lines(editor, from - 1, to, editor->size - to);
+    int size = editor->size - delta;
+    release_chunks(editor, chunk_count(size));
+    editor->size = size;
+    return size - from + 1;
+}
+
+/**
+ * Inserts count lines before position at (0 based, at most the size).
+ * @param editor (not null)
+ * @param at
+ * @param lines (not null)
+ * @param count
+ * @return the lines moved or written
+ */
+int insert_lines(snapshot_t *editor, int at, const line_t *lines, int count) {
+    if(count <= 0) return 0;
+    // the lines after at all change position
+    stale_hashes(editor, at >> CHUNK_SHIFT);
+    reserve_chunks(editor, chunk_count(editor->size + count));
+    move_lines_back(editor, at + count, at, editor->size - at);
+    editor->size += count;
+    write_span(editor, at, lines, count);
+    return editor->size - at;
+}
+
+/**
+ * Bounds an edit by the size of the document it applies to, so that it can be applied again without checks:
+ * an insert goes before line arg1, at most one past the end, and its lines become arg1..arg2 (so does a change,
+ * which only needs it inside a batch, where an earlier edit may have shortened the document);
+ * a move or a copy takes the lines of arg1..arg2 that exist to after line arg3, at most the last one.
+ * A move into its own range does nothing, like an empty range (arg2 < arg1). Deletes are bounded when applied.
+ * @param type
+ * @param size
+ * @param args the arguments, bounded in place (not null, 3 long)
+ */
+void clamp_shift(enum cmd_type type, int size, int *args) {
+    if(type == INSERT || type == CHANGE) {
+        int at = args[0] < 1 ? 0 : args[0] - 1;
+        if(at > size) at = size;
+        args[1] = at + args[1] - args[0] + 1;
+        args[0] = at + 1;
+    } else if(type == MOVE || type == COPY) {
+        int from = args[0] < 1 ? 1 : args[0], to = args[1] > size ? size : args[1];
+        int dest = args[2] < 0 ? 0 : args[2] > size ? size : args[2];
+        if(to < from || (type == MOVE && dest >= from - 1 && dest <= to)) from = 1, to = 0, dest = 0;
+        args[0] = from;
+        args[1] = to;
+        args[2] = dest;
+    }
+}
+
+/**
+ * Applies an edit to a document, bounding its arguments first (clamp_shift leaves bounded ones as they are).
+ * A move only rewrites the lines between its range and its destination, which keep their hashes.
+ * @param document (not null)
+ * @param op (not null)
+ * @return the lines moved or written
+ */
+int apply_edit(snapshot_t *document, edit_t *op) {
+    int written;
+    line_t *span;
+    clamp_shift(op->type, document->size, op->args);
+    int count = op->args[1] - op->args[0] + 1, from = op->args[0] - 1, dest = op->args[2];
+    if(op->type == CHANGE) {
+        write_lines(document, from, op->content_lines, count);
+        return count;
+    }
+    if(op->type == DELETE) return delete_lines(document, op->args[0], op->args[1]);
+    if(op->type == INSERT) return insert_lines(document, from, op->content_lines, count);
+    if(count <= 0) return 0;
+    if(op->type == COPY) {
+        span = (line_t *) malloc(count * sizeof(line_t));
+        read_span(document, from, count, span);
+        written = insert_lines(document, dest, span, count);
+    } else {
+        // rotate [lo, hi) so that the range ends up after line dest
+        int lo = from < dest ? from : dest, hi = op->args[1] > dest ? op->args[1] : dest;
+        span = (line_t *) malloc((hi - lo) * sizeof(line_t));
+        read_span(document, lo, hi - lo, span);
+        if(dest < from) {
+            write_lines(document, lo, span + (from - lo), count);
+            write_lines(document, lo + count, span, from - lo);
+        } else {
+            write_lines(document, lo, span + count, hi - lo - count);
+            write_lines(document, hi - count, span, count);
+        }
+        written = hi - lo;
+    }
+    free(span);
+    return written;
+}
+
+/**
+ * Applies the edit a snapshot was taken for, or all the edits of its batch.
+ * @param document (not null)
+ * @param taken (not null)
+ * @return the lines moved or written
+ */
+int shift_lines(snapshot_t *document, snapshot_t *taken) {
+    int written = 0;
+    if(taken->type == BATCH) {
+        for(int i = 0; i < taken->batch_size; i++) written += apply_edit(document, &taken->batch[i]);
+        return written;
+    }
+    edit_t op = {taken->type, {taken->arg1, taken->arg2, taken->arg3}, taken->content_lines};
+    return apply_edit(document, &op);
+}
+
+/**
+ * Rebuilds a delta snapshot from the closest full one before it, replaying every segment and delete
+ * in between on a copy of it (sharing its chunks). It is kept as a full snapshot from then on.
+ * @param snapshots (not null)
+ * @param commandWrap (not null)
+ * @param model (not null)
+ * @param target a delta snapshot
+ * @param threads the most threads the replay can use
+ */
+void materialize_snapshot(snapshot_t **snapshots, command_wrap_t *commandWrap, cost_model_t *model, int target, int threads) {
+    snapshot_t *document = snapshots[target];
+    int base = target;
+    while(snapshots[base]->delta) base--;
+    copy_editor(snapshots[base], document);
+    for(int i = base + 1; i <= target; i++) {
+        replay_changes(document, commandWrap, snapshots[i - 1]->index - (i - 1), snapshots[i]->index - i, threads);
+        shift_lines(document, snapshots[i]);
+    }
+    document->delta = false;
+    document->chain = 0;
+    model->rebuilt++;
+}
+
+/**
+ * Brings the editor to a snapshot, rebuilding it first if it is a delta.
+ * @param snapshots (not null)
+ * @param editor (not null)
+ * @param commandWrap (not null)
+ * @param model (not null)
+ * @param curr_snap the snapshot of the editor
+ * @param target
+ * @param threads the most threads the replay can use
+ */
+void restore_snapshot(snapshot_t **snapshots, snapshot_t *editor, command_wrap_t *commandWrap, cost_model_t *model, int curr_snap, int target, int threads) {
+    cost_restore(model, curr_snap > target ? curr_snap - target : target - curr_snap);
+    if(snapshots[target]->delta) materialize_snapshot(snapshots, commandWrap, model, target, threads);
+    // hash the snapshot once, rather than the editor after every restore
+    if(print_cache_on) document_digest(snapshots[target]);
+    pass_to_snapshot(editor, snapshots[target]);
+}
+
+/**
+ * @param commandWrap (not null)
+ * @param root root of a last writer index covering [0, 2^bits)
+ * @param bits
+ * @param at a line position
+ * @return the tag of the last change writing the line at the version of root, 0 if none
+ */
+int index_writer(command_wrap_t *commandWrap, int root, int bits, int at) {
+    int node = root, lo = 0, hi = 1 << bits, tag = 0;
+    if(at >= hi) return 0;
+    while(node != 0) {
+        int mid = lo + (hi - lo) / 2;
+        if(commandWrap->nodes[node].tag > tag) tag = commandWrap->nodes[node].tag;
+        if(at < mid) {
+            node = commandWrap->nodes[node].left;
+            hi = mid;
+        } else {
+            node = commandWrap->nodes[node].right;
+            lo = mid;
+        }
+    }
+    return tag;
+}
+
+/**
+ * Finds a version of the linear history: the snapshot before it and the last writer index
+ * of the changes of its segment up to it.
+ * @param snapshots (not null)
+ * @param snap_size
+ * @param commandWrap (not null)
+ * @param version at most commandWrap->size + snap_size
+ * @param snap where to put the snapshot (not null)
+ * @param root where to put the root of the index, 0 if no change follows the snapshot (not null)
+ * @param bits where to put the bits of the index (not null)
+ * @return the number of lines of the version
+ */
+int locate_version(snapshot_t **snapshots, int snap_size, command_wrap_t *commandWrap, int version, int *snap, int *root, int *bits) {
+    int t = backward_search_snapshot(snapshots, snap_size, version);
+    // the changes [first, last) of the segment of t lead from the snapshot to the version
+    int first = snapshots[t]->index - t, last = version - t;
+    int size = snapshots[t]->size;
+    *snap = t;
+    *root = 0;
+    *bits = 0;
+    if(last > first) {
+        index_changes(commandWrap, last);
+        *root = commandWrap->commands[last - 1]->index_root;
+        *bits = commandWrap->commands[last - 1]->index_bits;
+        int extent = index_extent(commandWrap, *root, 0, 1 << *bits);
+        if(extent > size) size = extent;
+    }
+    return size;
+}
+
+/**
+ * Handles a print at a past (or undone) version, reading it from the history: every line comes from the
+ * last change writing it since the snapshot before the version (found in the last writer index), or from
+ * that snapshot. Neither the editor nor the undo/redo state change. A delta snapshot is rebuilt first.
+ * Versions past the end of the history have no lines.
+ * @param snapshots (not null)
+ * @param snap_size
+ * @param commandWrap (not null)
+ * @param model (not null)
+ * @param threads the most threads a rebuild can use
+ * @param version the value of the command counter at that version
+ * @param arg1
+ * @param arg2
+ */
+void handle_print_at(snapshot_t **snapshots, int snap_size, command_wrap_t *commandWrap, cost_model_t *model, int threads, int version, int arg1, int arg2) {
+    int dots = arg2 - arg1 + 1;
+    int t, root, bits;
+    if(version > commandWrap->size + snap_size) {
+        print_dots(dots);
+        return;
+    }
+    int size = locate_version(snapshots, snap_size, commandWrap, version, &t, &root, &bits);
+    if(snapshots[t]->delta) materialize_snapshot(snapshots, commandWrap, model, t, threads);
+    snapshot_t *base = snapshots[t];
+    if(arg1 > 0 && arg1 <= size) {
+        int to = arg2 > size ? size : arg2;
+        for(int i = arg1 - 1; i < to; i++) {
+            int tag = index_writer(commandWrap, root, bits, i);
+            if(tag > 0) {
+                command_t *command = commandWrap->commands[tag - 1];
+                print_line(&command->content_lines[i - command->arg1 + 1]);
+            } else {
+                print_line(get_line(base, i));
+            }
+        }
+        dots -= to - arg1 + 1;
+    }
+    print_dots(dots);
+}
+
+/**
+ * Appends lines to a version, merging them with the last piece when they continue it.
+ * @param list (not null)
+ * @param from the position in the base of the first line, -1 for new lines
+ * @param len
+ */
+void pieces_push(piece_list_t *list, int from, int len) {
+    if(len <= 0) return;
+    if(list->size > 0) {
+        piece_t *last = &list->pieces[list->size - 1];
+        if((last->from < 0 && from < 0) || (last->from >= 0 && last->from + last->len == from)) {
+            last->len += len;
+            return;
+        }
+    }
+    if(list->size >= list->capacity) {
+        list->capacity = list->capacity == 0 ? CAPACITY_CONST : 2 * list->capacity;
+        list->pieces = (piece_t *) realloc(list->pieces, list->capacity * sizeof(piece_t));
+    }
+    list->pieces[list->size].from = from < 0 ? -1 : from;
+    list->pieces[list->size].len = len;
+    list->size++;
+}
+
+/**
+ * Starts a version equal to the base. Every position is kept, even past the end of the base, so edits
+ * do not need the size of the version they apply to: pieces_finish drops the lines that do not exist.
+ * @param list (not null)
+ */
+void pieces_start(piece_list_t *list) {
+    list->size = 0;
+    pieces_push(list, 0, 1 << MAX_INDEX_BITS);
+}
+
+/**
+ * Replaces the lines in [at, at + count) of a version with fresh new lines.
+ * @param list (not null)
+ * @param scratch where the new list is built, it is swapped with list (not null)
+ * @param at
+ * @param count
+ * @param fresh
+ */
+void pieces_edit(piece_list_t *list, piece_list_t *scratch, int at, int count, int fresh) {
+    piece_list_t swap;
+    int pos = 0;
+    scratch->size = 0;
+    for(int i = 0; i < list->size && pos < at; i++) {
+        int len = list->pieces[i].len;
+        pieces_push(scratch, list->pieces[i].from, (pos + len < at ? len : at - pos));
+        pos += len;
+    }
+    pieces_push(scratch, -1, fresh);
+    pos = 0;
+    for(int i = 0; i < list->size; i++) {
+        int len = list->pieces[i].len;
+        int skip = at + count - pos;
+        if(skip < len) {
+            if(skip < 0) skip = 0;
+            pieces_push(scratch, list->pieces[i].from < 0 ? -1 : list->pieces[i].from + skip, len - skip);
+        }
+        pos += len;
+    }
+    swap = *list;
+    *list = *scratch;
+    *scratch = swap;
+}
+
+/**
+ * Appends the lines in [from, to) of a version to another one.
+ * @param list (not null)
+ * @param out (not null)
+ * @param from
+ * @param to
+ */
+void pieces_slice(piece_list_t *list, piece_list_t *out, int from, int to) {
+    int pos = 0;
+    for(int i = 0; i < list->size && pos < to; i++) {
+        int len = list->pieces[i].len, lo = from > pos ? from - pos : 0, hi = to - pos < len ? to - pos : len;
+        if(lo < hi) pieces_push(out, list->pieces[i].from < 0 ? -1 : list->pieces[i].from + lo, hi - lo);
+        pos += len;
+    }
+}
+
+/**
+ * Applies an edit to a version, with the same bounds as the editor (inserts, moves and copies come bounded
+ * by clamp_shift).
+ * @param list (not null)
+ * @param scratch (not null)
+ * @param type CHANGE, DELETE, INSERT, MOVE or COPY
+ * @param arg1
+ * @param arg2
+ * @param arg3
+ */
+void pieces_apply(piece_list_t *list, piece_list_t *scratch, enum cmd_type type, int arg1, int arg2, int arg3) {
+    piece_list_t swap;
+    int from = arg1 <= 0 ? 1 : arg1;
+    if(type == CHANGE) pieces_edit(list, scratch, arg1 - 1, arg2 - arg1 + 1, arg2 - arg1 + 1);
+    else if(type == DELETE && arg2 >= from) pieces_edit(list, scratch, from - 1, arg2 - from + 1, 0);
+    else if(type == INSERT) pieces_edit(list, scratch, arg1 - 1, 0, arg2 - arg1 + 1);
+    if((type != MOVE && type != COPY) || arg2 < arg1) return;
+    // the lines before the destination, the range, then the rest
+    scratch->size = 0;
+    if(type == COPY || arg3 < arg1) {
+        pieces_slice(list, scratch, 0, arg3);
+        pieces_slice(list, scratch, arg1 - 1, arg2);
+        if(type == MOVE) pieces_slice(list, scratch, arg3, arg1 - 1);
+        pieces_slice(list, scratch, type == COPY ? arg3 : arg2, INT_MAX);
+    } else {
+        pieces_slice(list, scratch, 0, arg1 - 1);
+        pieces_slice(list, scratch, arg2, arg3);
+        pieces_slice(list, scratch, arg1 - 1, arg2);
+        pieces_slice(list, scratch, arg3, INT_MAX);
+    }
+    swap = *list;
+    *list = *scratch;
+    *scratch = swap;
+}
+
+/**
+ * Applies the edits of a batch to a version, in order (they come bounded by clamp_shift).
+ * @param list (not null)
+ * @param scratch (not null)
+ * @param edits
+ * @param size
+ */
+void pieces_apply_batch(piece_list_t *list, piece_list_t *scratch, const edit_t *edits, int size) {
+    for(int i = 0; i < size; i++) pieces_apply(list, scratch, edits[i].type, edits[i].args[0], edits[i].args[1], edits[i].args[2]);
+}
+
+/**
+ * Drops the lines past the end of the base. Kept lines out of base order (moved) count as new ones:
+ * only the lines of a piece in order are proved equal to the base.
+ * @param list (not null)
+ * @param scratch (not null)
+ * @param base_size
+ */
+void pieces_finish(piece_list_t *list, piece_list_t *scratch, int base_size) {
+    piece_list_t swap;
+    int next = 0;
+    scratch->size = 0;
+    for(int i = 0; i < list->size; i++) {
+        piece_t piece = list->pieces[i];
+        if(piece.from < 0) {
+            pieces_push(scratch, -1, piece.len);
+            continue;
+        }
+        if(piece.from + piece.len > base_size) piece.len = base_size - piece.from;
+        if(piece.len <= 0) continue;
+        if(piece.from < next) {
+            pieces_push(scratch, -1, piece.len);
+        } else {
+            pieces_push(scratch, piece.from, piece.len);
+            next = piece.from + piece.len;
+        }
+    }
+    swap = *list;
+    *list = *scratch;
+    *scratch = swap;
+}
+
+/**
+ * Prints a hunk in the format of diff: lines (from, to] of the old version replaced by lines (from, to]
+ * of the new one.
+ * @param old_from
+ * @param old_to
+ * @param new_from
+ * @param new_to
+ */
+void print_hunk(int old_from, int old_to, int new_from, int new_to) {
+    char text[64];
+    int len;
+    if(old_from == old_to && new_from == new_to) return;
+    if(old_from == old_to) len = snprintf(text, sizeof(text), "%da", old_from);
+    else if(old_to - old_from == 1) len = snprintf(text, sizeof(text), "%d%c", old_to, new_from == new_to ? 'd' : 'c');
+    else len = snprintf(text, sizeof(text), "%d,%d%c", old_from + 1, old_to, new_from == new_to ? 'd' : 'c');
+    if(new_from == new_to || new_to - new_from == 1) len += snprintf(text + len, sizeof(text) - len, "%d\n", new_to);
+    else len += snprintf(text + len, sizeof(text) - len, "%d,%d\n", new_from + 1, new_to);
+    emit(text, len);
+}
+
+/**
+ * Prints the hunks between two versions of the same base: the lines kept from the same base lines are
+ * the same (their descriptors are shared), everything between two runs of them changed.
+ * Costs O(pieces), whatever the size of the versions.
+ * @param old_list (not null, finished)
+ * @param new_list (not null, finished)
+ */
+void print_diff(piece_list_t *old_list, piece_list_t *new_list) {
+    piece_list_t *lists[2] = {old_list, new_list};
+    int piece[2] = {0, 0}, used[2] = {0, 0}, pos[2] = {0, 0}, end[2] = {0, 0};
+    while(true) {
+        // skip new lines and what is left of consumed pieces
+        for(int k = 0; k < 2; k++) {
+            while(piece[k] < lists[k]->size
+                  && (lists[k]->pieces[piece[k]].from < 0 || used[k] == lists[k]->pieces[piece[k]].len)) {
+                pos[k] += lists[k]->pieces[piece[k]].len - used[k];
+                piece[k]++;
+                used[k] = 0;
+            }
+        }
+        if(piece[0] == lists[0]->size || piece[1] == lists[1]->size) break;
+        int from[2], left[2];
+        for(int k = 0; k < 2; k++) {
+            from[k] = lists[k]->pieces[piece[k]].from + used[k];
+            left[k] = lists[k]->pieces[piece[k]].len - used[k];
+        }
+        if(from[0] != from[1]) {
+            // base lines only one of them kept
+            int k = from[0] < from[1] ? 0 : 1;
+            int skip = from[1 - k] - from[k] < left[k] ? from[1 - k] - from[k] : left[k];
+            used[k] += skip;
+            pos[k] += skip;
+            continue;
+        }
+        int len = left[0] < left[1] ? left[0] : left[1];
+        print_hunk(end[0], pos[0], end[1], pos[1]);
+        for(int k = 0; k < 2; k++) {
+            used[k] += len;
+            pos[k] += len;
+            end[k] = pos[k];
+        }
+    }
+    for(int k = 0; k < 2; k++) {
+        for(int i = piece[k]; i < lists[k]->size; i++) pos[k] += lists[k]->pieces[i].len;
+        pos[k] -= used[k];
+    }
+    print_hunk(end[0], pos[0], end[1], pos[1]);
+    emit(".\n", 2);
+}
+
+/**
+ * Handles a diff between two versions of the linear history: the edits from the older one to the newer one
+ * are applied to pieces of the older one, O(edits * pieces) whatever the size of the document.
+ * Versions past the end of the history print no hunk.
+ * @param snapshots (not null)
+ * @param snap_size
+ * @param commandWrap (not null)
+ * @param from the old version
+ * @param to the new version
+ */
+void handle_diff(snapshot_t **snapshots, int snap_size, command_wrap_t *commandWrap, int from, int to) {
+    piece_list_t base = {0, 0, NULL}, other = {0, 0, NULL}, scratch = {0, 0, NULL};
+    int lo = from < to ? from : to, hi = from < to ? to : from;
+    int t, root, bits;
+    if(hi > commandWrap->size + snap_size) {
+        emit(".\n", 2);
+        return;
+    }
+    int size = locate_version(snapshots, snap_size, commandWrap, lo, &t, &root, &bits);
+    pieces_start(&base);
+    pieces_start(&other);
+    for(int v = lo + 1; v <= hi; v++) {
+        if(t < snap_size && snapshots[t + 1]->index == v) {
+            t++;
+            if(snapshots[t]->type == BATCH) pieces_apply_batch(&other, &scratch, snapshots[t]->batch, snapshots[t]->batch_size);
+            else pieces_apply(&other, &scratch, snapshots[t]->type, snapshots[t]->arg1, snapshots[t]->arg2, snapshots[t]->arg3);
+        } else {
+            command_t *command = commandWrap->commands[v - t - 1];
+            pieces_apply(&other, &scratch, CHANGE, command->arg1, command->arg2, 0);
+        }
+    }
+    pieces_finish(&base, &scratch, size);
+    pieces_finish(&other, &scratch, size);
+    if(from <= to) print_diff(&base, &other);
+    else print_diff(&other, &base);
+    free(base.pieces);
+    free(other.pieces);
+    free(scratch.pieces);
+}
+
+/**
+ * Finds the version a line first appeared in: the one made by the change, the insert or the batch that read it.
+ * All of them read their lines in order: the insert or the batch is the first snapshot taken after the line was
+ * read, if it read it, otherwise the change is the last one whose first line was read before it.
+ * @param snapshots (not null)
+ * @param snap_size
+ * @param commandWrap (not null)
+ * @param id the id of a line of the current version
+ * @return the version, as counted by the command counter
+ */
+int line_version(snapshot_t **snapshots, int snap_size, command_wrap_t *commandWrap, unsigned int id) {
+    int lo = 1, hi = snap_size + 1;
+    while(lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if(snapshots[mid]->line_end > id) hi = mid;
+        else lo = mid + 1;
+    }
+    if(lo <= snap_size && snapshots[lo]->line_begin <= id) return snapshots[lo]->index;
+    lo = 0;
+    hi = commandWrap->size - 1;
+    while(lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if(commandWrap->commands[mid]->content_lines[0].id <= id) lo = mid;
+        else hi = mid - 1;
+    }
+    // the segment of the change: the last snapshot taken before it
+    int change = lo, t = 0;
+    hi = snap_size;
+    while(t < hi) {
+        int mid = t + (hi - t + 1) / 2;
+        if(snapshots[mid]->index - mid <= change) t = mid;
+        else hi = mid - 1;
+    }
+    return change + t + 1;
+}
+
+/**
+ * Adds the lines read by the edits of a batch to the search index.
+ * @param blooms (not null)
+ * @param edits
+ * @param size
+ */
+void search_index_batch(unsigned long long *blooms, const edit_t *edits, int size) {
+    for(int i = 0; i < size; i++) {
+        if(edits[i].content_lines == NULL) continue;
+        for(int j = 0; j <= edits[i].args[1] - edits[i].args[0]; j++) search_index_line(blooms, &edits[i].content_lines[j]);
+    }
+}
+
+/**
+ * Handles a search: prints the position of every line of the current version containing the pattern,
+ * with the version it first appeared in, then a line with a '.'. Only the lines whose block of ids
+ * may contain the pattern (by the trigram index) are read.
+ * @param editor (not null)
+ * @param snapshots (not null)
+ * @param snap_size
+ * @param commandWrap (not null)
+ * @param pattern (not null)
+ * @param len
+ */
+void handle_search(snapshot_t *editor, snapshot_t **snapshots, int snap_size, command_wrap_t *commandWrap, const char *pattern, int len) {
+    unsigned long long *blooms = search_index_reserve();
+    for(; blooms != NULL && commandWrap->indexed < commandWrap->size; commandWrap->indexed++) {
+        command_t *command = commandWrap->commands[commandWrap->indexed];
+        search_index_lines(blooms, command->content_lines, command->arg2 - command->arg1 + 1);
+    }
+    for(; blooms != NULL && commandWrap->indexed_snap < snap_size; commandWrap->indexed_snap++) {
+        snapshot_t *taken = snapshots[commandWrap->indexed_snap + 1];
+        if(taken->type == BATCH) search_index_batch(blooms, taken->batch, taken->batch_size);
+        if(taken->type != INSERT) continue;
+        for(int i = 0; i <= taken->arg2 - taken->arg1; i++) search_index_line(blooms, &taken->content_lines[i]);
+    }
+    unsigned long long *candidates = search_candidates(pattern, len);
+    for(int c = 0; c < chunk_count(editor->size); c++) {
+        const line_t *lines = editor->chunks[c]->lines;
+        int count = editor->size - (c << CHUNK_SHIFT) < CHUNK_LINES ? editor->size - (c << CHUNK_SHIFT) : CHUNK_LINES;
+        for(int i = 0; i < count; i++) {
+            if(line_matches(&lines[i], pattern, len, candidates)) {
+                print_match((c << CHUNK_SHIFT) + i + 1, line_version(snapshots, snap_size, commandWrap, lines[i].id));
+            }
+        }
+    }
+    free(candidates);
+    emit(".\n", 2);
+}
+
+/**
+ * Handle an edit shifting lines: a delete, an insert, a move, a copy or the commit of a batch.
+ *      * apply it to the editor (an insert reads its lines first, a batch applies its edits in order)
+ *      * put a new snapshot into the main structure: a full one sharing the editor's content,
+ *        or a delta if the cost model expects it to be cheaper
+ * @param editor (not null)
+ * @param snapshot (not null)
+ * @param snap_size
+ * @param commandWrap (not null)
+ * @param model (not null)
+ * @param type DELETE, INSERT, MOVE, COPY or BATCH
+ * @param args (not null, 3 long)
+ * @param batch the edits of a BATCH, taken over by the snapshot (not null)
+ */
+void handle_shift(snapshot_t *editor, snapshot_t **snapshot, int snap_size, command_wrap_t *commandWrap, cost_model_t *model, enum cmd_type type, const int *args, batch_t *batch) {
+    snapshot_t *previous = snapshot[snap_size - 1], *taken = snapshot[snap_size];
+    int bounded[3] = {args[0], args[1], args[2]};
+    // rebuilding it means rebuilding the previous snapshot, its segment and the shift
+    long long chain = previous->delta ? previous->chain : 0;
+    chain += replay_width(commandWrap, previous->index - (snap_size - 1), taken->index - snap_size);
+    clamp_shift(type, editor->size, bounded);
+    taken->type = type;
+    taken->arg1 = bounded[0];
+    taken->arg2 = bounded[1];
+    taken->arg3 = bounded[2];
+    taken->line_begin = search_index.next_id;
+    if(type == INSERT) taken->content_lines = read_content(bounded[1] - bounded[0] + 1);
+    if(type == BATCH) {
+        taken->batch = batch->edits;
+        taken->batch_size = batch->size;
+        taken->line_begin = batch->line_begin;
+        *batch = (batch_t) {false, 0, 0, NULL, 0};
+    }
+    taken->line_end = search_index.next_id;
+    chain += shift_lines(editor, taken);
+
+    ewma(&model->doc_size, editor->size);
+    ewma(&model->segment_changes, model->changes);
+    ewma(&model->restore_rate, model->restores);
+    model->changes = 0;
+    model->restores = 0;
+    if(keep_snapshot(model, chain, editor->size)) {
+        // the snapshot shares the new content
+        copy_editor(editor, snapshot[snap_size]);
+        model->full++;
+        return;
+    }
+    snapshot[snap_size]->delta = true;
+    snapshot[snap_size]->size = editor->size;
+    snapshot[snap_size]->chain = chain;
+    model->deltas++;
+}
+
+/**
+ * Handle undo.
+ * @param snapshots (not null)
+ * @param editor (not null)
+ * @param commandWrap (not null)
+ * @param undo_count
+ * @param redo_count
+ * @param snap_size the amount of snapshots alloc'd in the main structure
+ * @param command_counter
+ * @param executed_undos the amount of temporary executed undos in the past
+ * @param curr_snap the index of the closest snapshot
+ * @param model (not null)
+ * @param threads the most threads the replay can use
+ */
+void handle_undo(snapshot_t **snapshots, snapshot_t *editor,  command_wrap_t *commandWrap, int undo_count, int redo_count, int snap_size, int *command_counter, int *executed_undos, int *curr_snap, cost_model_t *model, int threads) {
+    // find the right snapshot to jump back to
+    int target;
+    if(undo_count - redo_count >= *command_counter)
+        target = 0;
+    else
+        target = backward_search_snapshot(snapshots, snap_size, *command_counter - (undo_count - redo_count));
+    // copy snapshot into editor
+    restore_snapshot(snapshots, editor, commandWrap, model, *curr_snap, target, threads);
+    *curr_snap = target;
+    // shift back to the right command (command counter)
+    *command_counter -= undo_count - redo_count;
+    // execute changes until counter reaches command_counter - (undo_count - redo_count)
+    replay_changes(editor, commandWrap, snapshots[target]->index - target, *command_counter - target, threads);
+    *executed_undos += undo_count - redo_count;
+}
+
+/**
+ * Handle redo.
+ * @param snapshots (not null)
+ * @param editor (not null)
+ * @param commandWrap (not null)
+ * @param steps amount of steps to redo
+ * @param snap_size the amount of snapshots alloc'd in the main structure
+ * @param command_counter
+ * @param curr_snap the index of the closest snapshot
+ * @param model (not null)
+ * @param threads the most threads the replay can use
+ */
+void handle_redo(snapshot_t **snapshots, snapshot_t *editor,  command_wrap_t *commandWrap, int steps, int snap_size, int *command_counter, int *curr_snap, cost_model_t *model, int threads) {
+    // find right snapshot to jump forward to (if needed)
+    int target = backward_search_snapshot(snapshots, snap_size, *command_counter + (steps));
+    // the editor is already at command_counter, only the newer changes of the segment are needed
+    int first = *command_counter - target;
+    if(target != *curr_snap) {
+        // (if needed) copy new snapshot into editor
+        restore_snapshot(snapshots, editor, commandWrap, model, *curr_snap, target, threads);
+        *curr_snap = target;
+        first = snapshots[target]->index - target;
+    }
+    *command_counter += steps;
+    // execute changes until command_counter - (redo_count - undo_count) is reached
+    replay_changes(editor, commandWrap, first, *command_counter - target, threads);
+}
+
+/**
+ * Make a change or a delete permanent by deleting all current history.
+ * Nothing is freed here: the cut off snapshots and commands are only marked as stale,
+ * reclaim_history gives their memory back later.
+ * @param commandWrap  (not null)
+ * @param reclaim (not null)
+ * @param curr_snap
+ * @param snap_size
+ * @param curr_change index of the last usable change
+ */
+void make_permanent(command_wrap_t *commandWrap, reclaim_t *reclaim, int curr_snap, int snap_size, int curr_change) {
+    // snapshots in (curr_snap, snap_end] are stale
+    if(snap_size > reclaim->snap_end) reclaim->snap_end = snap_size;
+    // commands in [curr_change, cmd_end) are stale
+    if(commandWrap->size > reclaim->cmd_end) reclaim->cmd_end = commandWrap->size;
+    // their index nodes are the end of the arena
+    if(curr_change < commandWrap->index_end) {
+        commandWrap->node_size = commandWrap->commands[curr_change]->index_mark;
+        commandWrap->index_end = curr_change;
+    }
+    commandWrap->size = curr_change;
+    if(commandWrap->indexed > curr_change) commandWrap->indexed = curr_change;
+    if(commandWrap->indexed_snap > curr_snap) commandWrap->indexed_snap = curr_snap;
+}
+
+/**
+ * Detaches the content of a stale command and moves it into the graveyard.
+ * @param reclaim (not null)
+ * @param command (not null)
+ */
+void retire_command(reclaim_t *reclaim, command_t *command) {
+    if(command->content_lines == NULL) return;
+    if(reclaim->size >= reclaim->capacity) {
+        reclaim->graveyard = (command_t *) realloc(reclaim->graveyard, (reclaim->size + INCREASE_CONST) * sizeof(command_t));
+        reclaim->capacity = reclaim->size + INCREASE_CONST;
+    }
+    reclaim->graveyard[reclaim->size] = *command;
+    reclaim->size++;
+    if(readers != NULL) reclaim->epoch = atomic_load_explicit(&readers->published, memory_order_relaxed);
+    command->content_lines = NULL;
+    command->arg1 = 0;
+    command->arg2 = 0;
+}
+
+/**
+ * Frees the lines array of a stale snapshot. The lines of an insert, and of the changes and inserts of a batch,
+ * are moved into the graveyard, like the ones of a command.
+ * @param reclaim (not null)
+ * @param snapshot (not null)
+ */
+void retire_snapshot(reclaim_t *reclaim, snapshot_t *snapshot) {
+    if(snapshot->content_lines != NULL) {
+        command_t dead = {.arg1 = snapshot->arg1, .arg2 = snapshot->arg2, .content_lines = snapshot->content_lines};
+        retire_command(reclaim, &dead);
+        snapshot->content_lines = NULL;
+    }
+    for(int i = 0; i < snapshot->batch_size; i++) {
+        command_t dead = {.arg1 = snapshot->batch[i].args[0], .arg2 = snapshot->batch[i].args[1],
+                          .content_lines = snapshot->batch[i].content_lines};
+        retire_command(reclaim, &dead);
+    }
+    free(snapshot->batch);
+    snapshot->batch = NULL;
+    snapshot->batch_size = 0;
+    if(snapshot->chunks != NULL) release_chunks(snapshot, 0);
+    free(snapshot->chunks);
+    free(snapshot->hashes);
+    snapshot->chunks = NULL;
+    snapshot->hashes = NULL;
+    snapshot->digest = 0;
+    snapshot->index = 0;
+    snapshot->size = 0;
+    snapshot->capacity = 0;
+    snapshot->delta = false;
+}
+
+/**
+ * Gives back the memory of stale history, doing at most budget units of work.
+ * A unit is a single free, so no command pays for the whole abandoned branch.
+ * @param reclaim (not null)
+ * @param snapshots (not null)
+ * @param snap_size
+ * @param commandWrap (not null)
+ * @param budget
+ */
+void reclaim_history(reclaim_t *reclaim, snapshot_t **snapshots, int snap_size, command_wrap_t *commandWrap, int budget) {
+    while(budget > 0) {
+        if(reclaim->size > 0) {
+            // a reader may still be printing lines of the graveyard
+            if(readers != NULL && readers->emitted < reclaim->epoch) break;
+            // free the last detached command from its last line backwards
+            command_t *dead = &reclaim->graveyard[reclaim->size - 1];
+            while(budget > 0 && dead->arg2 >= dead->arg1) {
+                free_line(&dead->content_lines[dead->arg2 - dead->arg1]);
+                dead->arg2--;
+                budget--;
+            }
+            if(dead->arg2 < dead->arg1) {
+                free(dead->content_lines);
+                reclaim->size--;
+            }
+        } else if(reclaim->cmd_end > commandWrap->size) {
+            reclaim->cmd_end--;
+            retire_command(reclaim, commandWrap->commands[reclaim->cmd_end]);
+            budget--;
+        } else if(reclaim->snap_end > snap_size) {
+            retire_snapshot(reclaim, snapshots[reclaim->snap_end]);
+            reclaim->snap_end--;
+            budget--;
+        } else {
+            break;
+        }
+    }
+}
+
+/**
+ * Packs the text of the changes at least COLD_AGE changes old, in order, each one once, while more than
+ * COLD_RAW_MAX bytes of text are not packed: what is read again (printed, searched) after that is unpacked by
+ * line_text and stays so, what is left packed is in the history only, or in a part of the document nobody reads.
+ * Nothing is packed while a print is with the readers.
+ * @param cursor the first change not looked at yet (not null)
+ * @param commandWrap (not null)
+ * @param budget the lines to look at, at least one change is
+ */
+void cool_history(int *cursor, command_wrap_t *commandWrap, int budget) {
+    if(readers != NULL && readers->emitted < atomic_load_explicit(&readers->published, memory_order_relaxed)) return;
+    // changes past the end were cut off by make_permanent
+    if(*cursor > commandWrap->size) *cursor = commandWrap->size;
+    while(budget > 0 && cold_store.raw > COLD_RAW_MAX && *cursor + COLD_AGE <= commandWrap->size) {
+        command_t *command = commandWrap->commands[(*cursor)++];
+        cold_pack(command->content_lines, command->arg2 - command->arg1 + 1);
+        budget -= command->arg2 - command->arg1 + 1;
+    }
+}
+
+/**
+ * Random number used to balance the persistent tree (xorshift64*).
+ * @return
+ */
+unsigned long long tree_rand() {
+    static unsigned long long state = 0x9E3779B97F4A7C15ULL;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+int tree_size(tree_node_t *node) {
+    return node == NULL ? 0 : node->size;
+}
+
+/**
+ * Allocates a new immutable tree node.
+ * @param line the line content
+ * @param left
+ * @param right
+ * @return the new node
+ */
+tree_node_t *tree_new(line_t line, tree_node_t *left, tree_node_t *right) {
+    tree_node_t *node = (tree_node_t *) malloc(sizeof(tree_node_t));
+    unsigned long long left_hash = left == NULL ? 0 : left->hash, left_power = left == NULL ? 1 : left->power;
+    node->line = line;
+    node->left = left;
+    node->right = right;
+    node->size = tree_size(left) + tree_size(right) + 1;
+    // left, then the line, then right shifted past both
+    node->hash = left_hash + line_digest(&node->line) * left_power;
+    node->power = left_power * DIGEST_BASE;
+    if(right != NULL) {
+        node->hash += right->hash * node->power;
+        node->power *= right->power;
+    }
+    return node;
+}
+
+/**
+ * Concatenates two trees. Nodes on the merge path are copied, the inputs stay untouched.
+ * The root is picked with probability proportional to the size of each side, so shared
+ * subtrees keep the tree balanced in expectation.
+ * @param left
+ * @param right
+ * @return the concatenation of left and right
+ */
+tree_node_t *tree_merge(tree_node_t *left, tree_node_t *right) {
+    if(left == NULL) return right;
+    if(right == NULL) return left;
+    if(tree_rand() % (unsigned long long) (left->size + right->size) < (unsigned long long) left->size) {
+        return tree_new(left->line, left->left, tree_merge(left->right, right));
+    }
+    return tree_new(right->line, tree_merge(left, right->left), right->right);
+}
+
+/**
+ * Splits a tree after its first count lines. Nodes on the split path are copied.
+ * @param node
+ * @param count
+ * @param left where to put the first count lines (not null)
+ * @param right where to put the remaining lines (not null)
+ */
+void tree_split(tree_node_t *node, int count, tree_node_t **left, tree_node_t **right) {
+    tree_node_t *tmp;
+    if(node == NULL) {
+        *left = NULL;
+        *right = NULL;
+    } else if(tree_size(node->left) >= count) {
+        tree_split(node->left, count, left, &tmp);
+        *right = tree_new(node->line, tmp, node->right);
+    } else {
+        tree_split(node->right, count - tree_size(node->left) - 1, &tmp, right);
+        *left = tree_new(node->line, node->left, tmp);
+    }
+}
+
+/**
+ * Builds a balanced tree out of an array of lines.
+ * @param lines (not null)
+ * @param count
+ * @return
+ */
+tree_node_t *tree_build(line_t *lines, int count) {
+    if(count <= 0) return NULL;
+    int mid = count / 2;
+    return tree_new(lines[mid], tree_build(lines, mid), tree_build(lines + mid + 1, count - mid - 1));
+}
+
+/**
+ * Prints the lines with position in [from, to) (0 based), skipping the subtrees out of range.
+ * @param node
+ * @param from
+ * @param to
+ */
+void tree_print(tree_node_t *node, int from, int to) {
+    if(node == NULL || to <= 0 || from >= node->size) return;
+    int left_size = tree_size(node->left);
+    tree_print(node->left, from, to);
+    if(from <= left_size && left_size < to) print_line(&node->line);
+    tree_print(node->right, from - left_size - 1, to - left_size - 1);
+}
+
+/**
+ * Collects the ids of the lines in [from, to) of the subtree, in order.
+ * @param node
+ * @param from
+ * @param to
+ * @param ids where to write them (not null)
+ * @return the end of the ids written
+ */
+unsigned int *tree_ids(tree_node_t *node, int from, int to, unsigned int *ids) {
+    if(node == NULL || to <= 0 || from >= node->size) return ids;
+    int left_size = tree_size(node->left);
+    ids = tree_ids(node->left, from, to, ids);
+    if(from <= left_size && left_size < to) *ids++ = node->line.id;
+    return tree_ids(node->right, from - left_size - 1, to - left_size - 1, ids);
+}
+
+/**
+ * Gets the ancestor of version at the given depth, following jump pointers when they do not overshoot.
+ * @param version (not null)
+ * @param depth
+ * @return
+ */
+version_t *version_ancestor(version_t *version, int depth) {
+    while(version->depth > depth) {
+        if(version->jump->depth >= depth) version = version->jump;
+        else version = version->parent;
+    }
+    return version;
+}
+
+/**
+ * Adds a new version as a child of the current one and moves to it.
+ * @param tree (not null)
+ * @param root the document of the new version
+ * @param type the edit making it: CHANGE, DELETE, INSERT, MOVE, COPY or BATCH
+ * @param args the arguments of the edit (not null, 3 long)
+ */
+void tree_add_version(undo_tree_t *tree, tree_node_t *root, enum cmd_type type, const int *args) {
+    version_t *parent = tree->curr;
+    version_t *version = (version_t *) malloc(sizeof(version_t));
+    version->root = root;
+    version->type = type;
+    version->arg1 = args[0];
+    version->arg2 = args[1];
+    version->arg3 = args[2];
+    version->batch = NULL;
+    version->batch_size = 0;
+    version->parent = parent;
+    version->depth = parent->depth + 1;
+    version->id = tree->size;
+    version->children = 0;
+    version->line_end = search_index.next_id;
+    // skew-binary jump pointers: O(log N) ancestor search with one pointer per version
+    if(parent->depth - parent->jump->depth == parent->jump->depth - parent->jump->jump->depth) {
+        version->jump = parent->jump->jump;
+    } else {
+        version->jump = parent;
+    }
+    parent->children++;
+    if(tree->size >= tree->capacity) {
+        tree->capacity *= 2;
+        tree->versions = (version_t **) region_commit(&tree->region, tree->capacity * sizeof(version_t *), true);
+    }
+    tree->versions[tree->size] = version;
+    tree->size++;
+    tree->curr = version;
+    tree->tip = version;
+}
+
+/**
+ * Creates the undo tree with the empty document as its root version.
+ * @return
+ */
+undo_tree_t *new_undo_tree() {
+    undo_tree_t *tree = (undo_tree_t *) malloc(sizeof(undo_tree_t));
+    version_t *root = (version_t *) malloc(sizeof(version_t));
+    root->root = NULL;
+    root->parent = root;
+    root->jump = root;
+    root->depth = 0;
+    root->id = 0;
+    root->type = BOTTOM;
+    root->batch = NULL;
+    root->batch_size = 0;
+    root->children = 0;
+    root->line_end = search_index.next_id;
+    tree->region = (region_t) {NULL, 0, 0};
+    tree->versions = (version_t **) region_commit(&tree->region, INIT_CMD_LEN * sizeof(version_t *), true);
+    tree->capacity = INIT_CMD_LEN;
+    tree->versions[0] = root;
+    tree->size = 1;
+    tree->indexed = 1;
+    tree->curr = root;
+    tree->tip = root;
+    return tree;
+}
+
+/**
+ * Applies an edit to a document in tree mode: a few splits and merges, O(log N) plus the lines it reads.
+ * Like the linear engine, it is bounded by clamp_shift first, and an invalid delete changes nothing.
+ * @param root the document
+ * @param op (not null)
+ * @return the new document
+ */
+tree_node_t *tree_apply(tree_node_t *root, edit_t *op) {
+    tree_node_t *prefix, *rest, *range, *suffix, *between;
+    int count;
+
+    clamp_shift(op->type, tree_size(root), op->args);
+    count = op->args[1] - op->args[0] + 1;
+    if(op->type == DELETE) {
+        int from = op->args[0] <= 0 ? 1 : op->args[0];
+        int to = op->args[1] > tree_size(root) ? tree_size(root) : op->args[1];
+        if(to - from + 1 <= 0) return root;
+        tree_split(root, from - 1, &prefix, &rest);
+        tree_split(rest, to - from + 1, &range, &suffix);
+        return tree_merge(prefix, suffix);
+    }
+    if(op->type == CHANGE || op->type == INSERT) {
+        tree_split(root, op->args[0] - 1, &prefix, &rest);
+        // a change drops the lines it replaces
+        if(op->type == CHANGE) tree_split(rest, count, &range, &rest);
+        return tree_merge(tree_merge(prefix, tree_build(op->content_lines, count)), rest);
+    }
+    if(count <= 0) return root;
+    tree_split(root, op->args[0] - 1, &prefix, &rest);
+    tree_split(rest, count, &range, &suffix);
+    if(op->type == COPY) {
+        // the range stays, a shared copy of it goes after line dest
+        tree_split(root, op->args[2], &prefix, &suffix);
+        return tree_merge(tree_merge(prefix, range), suffix);
+    }
+    if(op->args[2] < op->args[0]) {
+        tree_split(prefix, op->args[2], &prefix, &between);
+        return tree_merge(tree_merge(prefix, range), tree_merge(between, suffix));
+    }
+    tree_split(suffix, op->args[2] - op->args[1], &between, &suffix);
+    return tree_merge(tree_merge(prefix, between), tree_merge(range, suffix));
+}
+
+/**
+ * Handles an edit in tree mode: a change or an insert reads its lines, then the edit makes a new version.
+ * The version records the edit bounded by clamp_shift, like the snapshot of the linear engine.
+ * @param tree (not null)
+ * @param type CHANGE, DELETE, INSERT, MOVE or COPY
+ * @param args (not null, 3 long)
  */
-void copy_editor(snapshot_t *editor, snapshot_t *dest) {
-    dest->size = editor->size;
-    dest->capacity = dest->size + CAPACITY_CONST;
-    dest->lines = (char **) malloc((dest->size + CAPACITY_CONST) * sizeof(char *));
-    for(int i = 0; i < dest->size; i++) {
-        dest->lines[i] = editor->lines[i];
-    }
-    for(int i = dest->size; i < dest->capacity; i++) {
-        dest->lines[i] = NULL;
-    }
+void tree_edit(undo_tree_t *tree, enum cmd_type type, const int *args) {
+    edit_t op = {type, {args[0], args[1], args[2]}, NULL};
+    clamp_shift(type, tree_size(tree->curr->root), op.args);
+    if(type == CHANGE || type == INSERT) op.content_lines = read_content(op.args[1] - op.args[0] + 1);
+    tree_add_version(tree, tree_apply(tree->curr->root, &op), type, op.args);
+    free(op.content_lines);
 }
 
 /**
- * copies dest content into the main editor object
- * @param editor (not null)
- * @param dest (not null)
+ * Commits a batch in tree mode: its edits are applied in order and make a single version, which keeps them
+ * (with their lines, for the search index) to replay them in diffs.
+ * @param tree (not null)
+ * @param batch (not null, open)
  */
-void pass_to_snapshot(snapshot_t *editor, snapshot_t *dest) {
-    int size = dest->size;
-    if(editor->capacity < dest->capacity) {
-        editor->lines = (char **) realloc(editor->lines, (dest->capacity + CAPACITY_CONST) * sizeof(char *));
-        for(int i = size; i < dest->capacity + CAPACITY_CONST; i++) {
-            editor->lines[i] = NULL;
-        }
-        editor->capacity = dest->capacity + CAPACITY_CONST;
-    }
-    editor->size = size;
-    for(int i = 0; i < size; i++) {
-        editor->lines[i] = dest->lines[i];
-    }
-    editor->index = dest->index;
+void tree_commit(undo_tree_t *tree, batch_t *batch) {
+    tree_node_t *root = tree->curr->root;
+    for(int i = 0; i < batch->size; i++) root = tree_apply(root, &batch->edits[i]);
+    tree_add_version(tree, root, BATCH, (int[]) {0, 0, 0});
+    tree->curr->batch = batch->edits;
+    tree->curr->batch_size = batch->size;
+    *batch = (batch_t) {false, 0, 0, NULL, 0};
 }
 
 /**
- * Gets the target snapshot to return to.
- * @param snapshots (not null)
- * @param snap_size
- * @param target_command
- * @return the index of the snapshot to return to
+ * @param root
+ * @return the digest of a version in tree mode, equal to the one of the same document in the linear engine
  */
-int backward_search_snapshot(snapshot_t **snapshots, int snap_size, int target_command) {
-    if(target_command >= snapshots[snap_size]->index) return snap_size;
-    for(int i = snap_size; i > 0; i--) {
-        if(target_command >= snapshots[i - 1]->index && target_command < snapshots[i]->index) {
-            return i - 1;
-        }
-    }
-    return 0;
+unsigned long long tree_digest(tree_node_t *root) {
+    return version_digest(root == NULL ? 0 : root->hash, tree_size(root));
 }
 
 /**
- * Handles print. Iterates through the lines structure, if the line has null content it prints '.\n',
- *  else prints the line's content.
- * @param editor (not null)
+ * Handles print in tree mode, with the same output as handle_print.
+ * @param root the document of the version to print
  * @param arg1
  * @param arg2
  */
-void handle_print(snapshot_t *editor, int arg1, int arg2) {
-    int delta = arg2 - arg1;
-    int count = 0;
-    int x = arg1 - 1;
-    while(count < delta + 1) {
-        if(x >= editor->size || x < 0) {
-            fputs(".\n", stdout);
-            count++;
-        } else {
-            fputs(editor->lines[x], stdout);
-            count++;
-            x++;
-        }
+void tree_handle_print(tree_node_t *root, int arg1, int arg2) {
+    int size = tree_size(root);
+    int dots = arg2 - arg1 + 1;
+    if(print_cache_usable()) {
+        int count = arg1 > 0 && arg1 <= size ? (arg2 > size ? size : arg2) - arg1 + 1 : 0;
+        tree_ids(root, arg1 - 1, arg1 - 1 + count, print_ids_reserve(count));
+        if(print_cache_begin(tree_digest(root), arg1, arg2, count)) return;
+    }
+    if(arg1 > 0 && arg1 <= size) {
+        int to = arg2 > size ? size : arg2;
+        tree_print(root, arg1 - 1, to);
+        dots -= to - arg1 + 1;
     }
+    print_dots(dots);
+    print_cache_end();
 }
 
 /**
- * Handle a change command. Put all new lines where they belong inside the editor.
- * @param editor (not null)
- * @param command (not null)
+ * Runs a reader thread: claims the published prints in order and renders each one into its job.
+ * @param arg the readers (not null)
+ * @return
  */
-void handle_change(snapshot_t *editor, command_t *command) {
-    char *input;
-    char buff[INPUT_MAX_LENGTH];
-    int arg2 = command->arg2;
-    int arg1 = command->arg1;
-
-    if(arg2 > editor->capacity) {
-        editor->lines = (char **) realloc(editor->lines, (arg2 + CAPACITY_CONST) * sizeof(char *));
-        for(int i = editor->capacity; i < arg2 + CAPACITY_CONST; i++) {
-            editor->lines[i] = NULL;
+void *reader_main(void *arg) {
+    readers_t *pool = (readers_t *) arg;
+    while(true) {
+        unsigned long long next = atomic_load(&pool->claimed);
+        if(next < atomic_load_explicit(&pool->published, memory_order_acquire)) {
+            if(!atomic_compare_exchange_weak(&pool->claimed, &next, next + 1)) continue;
+            print_job_t *job = &pool->jobs[next % READER_JOBS];
+            render = job;
+            job->len = 0;
+            if(job->pin != NULL) handle_print(&job->pin->document, job->arg1, job->arg2);
+            else tree_handle_print(job->root, job->arg1, job->arg2);
+            render = NULL;
+            atomic_store_explicit(&job->done, 1, memory_order_release);
+            continue;
+        }
+        if(atomic_load(&pool->stop)) return NULL;
+        // nothing to print: sleep until the writer publishes
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleeping, 1);
+        while(!atomic_load(&pool->stop) && atomic_load(&pool->claimed) >= atomic_load(&pool->published)) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
         }
-        editor->capacity = arg2 + CAPACITY_CONST;
+        atomic_fetch_sub(&pool->sleeping, 1);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * Starts the reader threads.
+ * @param count (at most MAX_READERS)
+ * @return the readers, NULL if no thread could be started
+ */
+readers_t *readers_start(int count) {
+    readers_t *pool = (readers_t *) calloc(1, sizeof(readers_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    // the block of dots is filled before any reader uses it
+    print_dots(0);
+    for(; pool->count < count; pool->count++) {
+        if(pthread_create(&pool->threads[pool->count], NULL, reader_main, pool) != 0) break;
     }
-    if(arg2 > editor->size) editor->size = arg2;
-    // alloc content lines
-    command->content_lines = (char **) malloc((arg2 - arg1 + 1) * sizeof(char *));
-    for(int i = arg1 - 1; i <= arg2 - 1; i++) {
-        fgets(buff, INPUT_MAX_LENGTH, stdin);
-        input = (char *)malloc((strlen(buff) + 1) * sizeof(char));
-        strcpy(input, buff);
-        editor->lines[i] = input;
-        command->content_lines[i - arg1 + 1] = input;
+    if(pool->count == 0) {
+        free(pool);
+        return NULL;
     }
-    // .\n
-    getchar_unlocked();
-    getchar_unlocked();
+    return pool;
 }
 
 /**
- * Redo a change. Puts all the lines that have been inserted by the command back where they belong.
+ * Pins the editor for a print: the latest pinned version if the editor still holds the same chunks
+ * (a chunk shared with a pin is copied before being written, so nothing changed), a new copy otherwise.
+ * @param pool (not null)
  * @param editor (not null)
- * @param command (not null)
+ * @return
  */
-void redo_change(snapshot_t *editor, command_t *command) {
-    int arg2 = command->arg2;
-    int arg1 = command->arg1;
-
-    if(arg2 > editor->capacity) {
-        editor->lines = (char **) realloc(editor->lines, (arg2 + CAPACITY_CONST) * sizeof(char *));
-        for(int i = editor->capacity; i < arg2 + CAPACITY_CONST; i++) {
-            editor->lines[i] = NULL;
-        }
-        editor->capacity = arg2 + CAPACITY_CONST;
+pin_t *readers_pin(readers_t *pool, snapshot_t *editor) {
+    pin_t *pin = pool->pins;
+    int count = chunk_count(editor->size);
+    if(pin == NULL || pin->document.size != editor->size
+       || (count > 0 && memcmp(pin->document.chunks, editor->chunks, count * sizeof(chunk_t *)) != 0)) {
+        pin = (pin_t *) calloc(1, sizeof(pin_t));
+        copy_editor(editor, &pin->document);
+        pin->next = pool->pins;
+        pool->pins = pin;
     }
-    if(arg2 > editor->size) editor->size = arg2;
+    pin->jobs++;
+    return pin;
+}
 
-    for(int i = arg1 - 1; i <= arg2 - 1; i++) {
-        editor->lines[i] = command->content_lines[i - arg1 + 1];
+/**
+ * Frees the pinned versions whose prints have all been emitted.
+ * @param pool (not null)
+ */
+void readers_release(readers_t *pool) {
+    pin_t **link = &pool->pins;
+    while(*link != NULL) {
+        pin_t *pin = *link;
+        if(pin->jobs > 0) {
+            link = &pin->next;
+            continue;
+        }
+        *link = pin->next;
+        release_chunks(&pin->document, 0);
+        free(pin->document.chunks);
+        free(pin->document.hashes);
+        free(pin);
     }
 }
 
 /**
- * Handle delete.
- *      * create a new snapshot and copy the editor' content
- *      * put the new snapshot into the main structure
- * @param editor (not null)
- * @param snapshot (not null)
- * @param snap_size
+ * Hands a print to the readers, waiting only if the ring is full of prints not emitted yet.
+ * @param pool (not null)
+ * @param editor the editor of the linear engine, NULL in tree mode
+ * @param root the version to print in tree mode
  * @param arg1
  * @param arg2
  */
-void handle_delete(snapshot_t *editor, snapshot_t **snapshot, int snap_size, int arg1, int arg2) {
-    int from, to;
-    if(arg1 <= 0) {
-        from = 1;
-    } else {
-        from = arg1;
+void readers_publish(readers_t *pool, snapshot_t *editor, tree_node_t *root, int arg1, int arg2) {
+    unsigned long long next = atomic_load_explicit(&pool->published, memory_order_relaxed);
+    while(next - pool->emitted >= READER_JOBS) {
+        readers_collect(pool, false);
+        if(next - pool->emitted >= READER_JOBS) sched_yield();
     }
-    if(arg2 > editor->size) {
-        to = editor->size;
-    } else {
-        to = arg2;
+    print_job_t *job = &pool->jobs[next % READER_JOBS];
+    // readers never unpack: the lines they print are unpacked here
+    for(int i = arg1 - 1; editor != NULL && cold_store.live > 0 && i < arg2 && i < editor->size; i++) {
+        if(i >= 0) line_text(get_line(editor, i));
     }
-    int delta = to - from + 1;
-    if(delta <= 0) {
-        // invalid delete, copy whole editor
-        copy_editor(editor, snapshot[snap_size]);
-        return;
+    job->pin = editor != NULL ? readers_pin(pool, editor) : NULL;
+    job->root = root;
+    job->arg1 = arg1;
+    job->arg2 = arg2;
+    atomic_store_explicit(&job->done, 0, memory_order_relaxed);
+    atomic_store(&pool->published, next + 1);
+    if(atomic_load(&pool->sleeping) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
     }
-    snapshot[snap_size]->lines = (char **) malloc((editor->size - delta) * sizeof(char *));
-    // copy first part
-    for(int i = 0; i < from - 1; i++) {
-        snapshot[snap_size]->lines[i] = editor->lines[i];
+}
+
+/**
+ * Emits every print left, stops the reader threads and frees them.
+ * @param pool (not null)
+ */
+void readers_stop(readers_t *pool) {
+    readers_collect(pool, true);
+    readers_release(pool);
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stop, true);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for(int i = 0; i < pool->count; i++) pthread_join(pool->threads[i], NULL);
+    for(int i = 0; i < READER_JOBS; i++) free(pool->jobs[i].data);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool);
+}
+
+/**
+ * Applies the edits from an ancestor down to a version.
+ * @param list (not null, started)
+ * @param scratch (not null)
+ * @param ancestor (not null)
+ * @param version (not null, a descendant of ancestor)
+ */
+void tree_pieces(piece_list_t *list, piece_list_t *scratch, version_t *ancestor, version_t *version) {
+    int count = version->depth - ancestor->depth;
+    version_t **path = (version_t **) malloc((count > 0 ? count : 1) * sizeof(version_t *));
+    for(int i = count - 1; i >= 0; i--) {
+        path[i] = version;
+        version = version->parent;
     }
-    for(int i = from - 1; i + delta < editor->size; i++) {
-        if(editor->lines[i + delta] == NULL) {
-            editor->lines[i] = NULL;
-            continue;
-        }
-        // shifted line
-        editor->lines[i] = editor->lines[i + delta];
-        editor->lines[i + delta] = NULL;
-        // copy shifted line
-        snapshot[snap_size]->lines[i] = editor->lines[i];
+    for(int i = 0; i < count; i++) {
+        if(path[i]->type == BATCH) pieces_apply_batch(list, scratch, path[i]->batch, path[i]->batch_size);
+        else pieces_apply(list, scratch, path[i]->type, path[i]->arg1, path[i]->arg2, path[i]->arg3);
     }
-    if(to == editor->size) {
-        for(int i = from - 1; i < editor->size; i++) {
-            editor->lines[i] = NULL;
-        }
-    } else {
-        for(int i = editor->size - delta; i < editor->size; i++) {
-            editor->lines[i] = NULL;
-        }
+    free(path);
+}
+
+/**
+ * Handles a diff in tree mode: both versions are compared to their closest common ancestor,
+ * by the edits on the way down to each of them.
+ * @param tree (not null)
+ * @param from the id of the old version
+ * @param to the id of the new version
+ */
+void tree_diff(undo_tree_t *tree, int from, int to) {
+    piece_list_t lists[2] = {{0, 0, NULL}, {0, 0, NULL}}, scratch = {0, 0, NULL};
+    if(from >= tree->size || to >= tree->size) {
+        emit(".\n", 2);
+        return;
     }
-    editor->size -= delta;
-    snapshot[snap_size]->size = editor->size;
-    snapshot[snap_size]->capacity = editor->size;
+    version_t *old_version = tree->versions[from], *new_version = tree->versions[to];
+    version_t *x = version_ancestor(old_version, new_version->depth), *y = version_ancestor(new_version, old_version->depth);
+    while(x != y) {
+        x = x->parent;
+        y = y->parent;
+    }
+    pieces_start(&lists[0]);
+    pieces_start(&lists[1]);
+    tree_pieces(&lists[0], &scratch, x, old_version);
+    tree_pieces(&lists[1], &scratch, x, new_version);
+    pieces_finish(&lists[0], &scratch, tree_size(x->root));
+    pieces_finish(&lists[1], &scratch, tree_size(x->root));
+    print_diff(&lists[0], &lists[1]);
+    free(lists[0].pieces);
+    free(lists[1].pieces);
+    free(scratch.pieces);
 }
 
 /**
- * Handle undo.
- * @param snapshots (not null)
- * @param editor (not null)
- * @param commandWrap (not null)
- * @param undo_count
- * @param redo_count
- * @param snap_size the amount of snapshots alloc'd in the main structure
- * @param command_counter
- * @param executed_undos the amount of temporary executed undos in the past
- * @param curr_snap the index of the closest snapshot
+ * Prints the matches of a search in a subtree, in order.
+ * @param tree (not null)
+ * @param node
+ * @param offset the number of lines before the subtree
+ * @param pattern (not null)
+ * @param len
+ * @param candidates the blocks that may contain the pattern (not null)
  */
-void handle_undo(snapshot_t **snapshots, snapshot_t *editor,  command_wrap_t *commandWrap, int undo_count, int redo_count, int snap_size, int *command_counter, int *executed_undos, int *curr_snap) {
-    // find the right snapshot to jump back to
-    int target;
-    if(undo_count - redo_count >= *command_counter)
-        target = 0;
-    else
-        target = backward_search_snapshot(snapshots, snap_size, *command_counter - (undo_count - redo_count));
-    // copy snapshot into editor
-    pass_to_snapshot(editor, snapshots[target]);
-    *curr_snap = target;
-    // shift back to the right command (command counter)
-    *command_counter -= undo_count - redo_count;
-    // execute changes until counter reaches command_counter - (undo_count - redo_count)
-    for(int i = snapshots[target]->index - target; i < *command_counter - target; i++) {
-        redo_change(editor, commandWrap->commands[i]);
+void tree_search_lines(undo_tree_t *tree, tree_node_t *node, int offset, const char *pattern, int len, const unsigned long long *candidates) {
+    while(node != NULL) {
+        tree_search_lines(tree, node->left, offset, pattern, len, candidates);
+        offset += tree_size(node->left);
+        if(line_matches(&node->line, pattern, len, candidates)) {
+            // the first version created after the line was read
+            int lo = 0, hi = tree->size - 1;
+            while(lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                if(tree->versions[mid]->line_end > node->line.id) hi = mid;
+                else lo = mid + 1;
+            }
+            print_match(offset + 1, lo);
+        }
+        offset++;
+        node = node->right;
     }
-    *executed_undos += undo_count - redo_count;
 }
 
 /**
- * Handle redo.
- * @param snapshots (not null)
- * @param editor (not null)
- * @param commandWrap (not null)
- * @param steps amount of steps to redo
- * @param snap_size the amount of snapshots alloc'd in the main structure
- * @param command_counter
- * @param curr_snap the index of the closest snapshot
+ * Adds the lines with position in [from, to) (0 based) to the search index.
+ * @param blooms (not null)
+ * @param node
+ * @param from
+ * @param to
  */
-void handle_redo(snapshot_t **snapshots, snapshot_t *editor,  command_wrap_t *commandWrap, int steps, int snap_size, int *command_counter, int *curr_snap) {
-    // find right snapshot to jump forward to (if needed)
-    int target = backward_search_snapshot(snapshots, snap_size, *command_counter + (steps));
-    if(target != *curr_snap) {
-        *curr_snap = target;
-        // (if needed) copy new snapshot into editor
-        pass_to_snapshot(editor, snapshots[target]);
+void tree_index_lines(unsigned long long *blooms, tree_node_t *node, int from, int to) {
+    if(node == NULL || to <= 0 || from >= node->size) return;
+    int left_size = tree_size(node->left);
+    tree_index_lines(blooms, node->left, from, to);
+    if(from <= left_size && left_size < to) search_index_line(blooms, &node->line);
+    tree_index_lines(blooms, node->right, from - left_size - 1, to - left_size - 1);
+}
+
+/**
+ * Handles a search in tree mode, with the same output as handle_search.
+ * The lines of a change are where it wrote them in its version.
+ * @param tree (not null)
+ * @param pattern (not null)
+ * @param len
+ */
+void tree_search(undo_tree_t *tree, const char *pattern, int len) {
+    unsigned long long *blooms = search_index_reserve();
+    for(; blooms != NULL && tree->indexed < tree->size; tree->indexed++) {
+        version_t *version = tree->versions[tree->indexed];
+        if(version->type == CHANGE || version->type == INSERT) tree_index_lines(blooms, version->root, version->arg1 - 1, version->arg2);
+        if(version->type == BATCH) search_index_batch(blooms, version->batch, version->batch_size);
     }
-    *command_counter += steps;
-    // execute changes until command_counter - (redo_count - undo_count) is reached
-    for(int i = snapshots[target]->index - target; i < *command_counter - target; i++) {
-        redo_change(editor, commandWrap->commands[i]);
+    unsigned long long *candidates = search_candidates(pattern, len);
+    tree_search_lines(tree, tree->curr->root, 0, pattern, len, candidates);
+    free(candidates);
+    emit(".\n", 2);
+}
+
+/**
+ * Lists the tips of all the branches, one id per line. The tip redo leads to is marked with '*'.
+ * @param tree (not null)
+ */
+void tree_list_branches(undo_tree_t *tree) {
+    char id[16];
+    for(int i = 0; i < tree->size; i++) {
+        if(tree->versions[i]->children == 0) {
+            emit(id, snprintf(id, sizeof(id), tree->versions[i] == tree->tip ? "*%d\n" : "%d\n", i));
+        }
     }
 }
 
 /**
- * Make a change or a delete permanent by deleting all current history.
- * @param snapshots  (not null)
- * @param commandWrap  (not null)
- * @param curr_snap
- * @param snap_size
- * @param curr_change index of the last usable change
+ * Executes a command in tree mode. Every move between versions only switches the document root.
+ *      * undo goes up towards the empty document
+ *      * redo goes down towards the tip of the current branch
+ *      * jump moves to any version and makes it the new tip
+ * @param tree (not null)
+ * @param command (not null)
+ * @param batch the open batch a commit applies (not null)
  */
-void make_permanent(snapshot_t **snapshots, command_wrap_t *commandWrap, int curr_snap, int snap_size, int curr_change) {
-    // delete all snapshots with index > curr_snap
-    for(int i = curr_snap + 1; i <= snap_size; i++) {
-        snapshots[i]->index = 0;
-        snapshots[i]->size = 0;
-        free(snapshots[i]->lines);
-        snapshots[i]->lines = NULL;
-        snapshots[i]->capacity = 0;
-    }
-    // delete all commands with index > curr_change
-    for(int i = curr_change; i < commandWrap->size; i++) {
-        for(int j = 0; j < commandWrap->commands[i]->arg2 - commandWrap->commands[i]->arg1 + 1; j++) {
-            free(commandWrap->commands[i]->content_lines[j]);
-        }
-        free(commandWrap->commands[i]->content_lines);
-        commandWrap->commands[i]->content_lines = NULL;
-        commandWrap->commands[i]->arg1 = 0;
-        commandWrap->commands[i]->arg2 = 0;
+void handle_tree_cmd(undo_tree_t *tree, cmd *command, batch_t *batch) {
+    int depth;
+    switch (command->type) {
+        case CHANGE:
+        case DELETE:
+        case INSERT:
+        case MOVE:
+        case COPY:
+            tree_edit(tree, command->type, command->args);
+            break;
+        case COMMIT:
+            tree_commit(tree, batch);
+            break;
+        case PRINT:
+            if(readers != NULL) readers_publish(readers, NULL, tree->curr->root, command->args[0], command->args[1]);
+            else tree_handle_print(tree->curr->root, command->args[0], command->args[1]);
+            break;
+        case PRINT_AT:
+            // any version, without moving to it
+            if(command->args[0] < tree->size) tree_handle_print(tree->versions[command->args[0]]->root, command->args[1], command->args[2]);
+            else print_dots(command->args[2] - command->args[1] + 1);
+            break;
+        case UNDO:
+            depth = tree->curr->depth - command->args[0];
+            tree->curr = version_ancestor(tree->curr, depth < 0 ? 0 : depth);
+            break;
+        case REDO:
+            depth = tree->curr->depth + command->args[0];
+            tree->curr = version_ancestor(tree->tip, depth > tree->tip->depth ? tree->tip->depth : depth);
+            break;
+        case BRANCHES:
+            tree_list_branches(tree);
+            break;
+        case DIGEST:
+            print_digest(tree_digest(tree->curr->root));
+            break;
+        case DIFF:
+            tree_diff(tree, command->args[0], command->args[1]);
+            break;
+        case SEARCH:
+            tree_search(tree, line_text(&command->text), line_content_len(&command->text));
+            free_line(&command->text);
+            break;
+        case JUMP:
+            if(command->args[0] < tree->size) {
+                tree->curr = tree->versions[command->args[0]];
+                tree->tip = tree->curr;
+            }
+            break;
+        default:
+            break;
     }
-    commandWrap->size = curr_change;
 }
+
 /**
- * Parses commands
+ * Parses commands. An invalid line is reported and skipped (INVALID, never journaled), the end of the input is a q.
  * @return
  */
 cmd* parse_cmd() {
-    char c;
-    int arg1 = 0, arg2 = 0;
+    int c, end;
+    int args[3] = {0, 0, 0};
+    int arg1, arg2;
+    // text is only set by a search
     cmd *ret = (cmd*) malloc(sizeof(cmd));
-    bool a1 = false;
-    int i = 0;
+    ret->type = CHANGE;
+    ret->args[0] = ret->args[1] = ret->args[2] = 0;
+    int a = 0;
 
-    c = getchar_unlocked();
+    c = next_char();
     while(c>='0' && c<='9') {
-        if(a1 == false) arg1 = 10 * arg1 + c - 48;
-        else arg2 = 10 * arg2 + c - 48;
-        c = getchar_unlocked();
+        args[a] = 10 * args[a] + c - 48;
+        c = next_char();
         if(c == '\n') break;
         else if(c == ',') {
-            a1 = true;
-            c = getchar_unlocked();
+            if(a < 2) a++;
+            c = next_char();
         }
     }
-    getchar_unlocked(); // '\n'
+    if(c == '/') {
+        // /text searches the current version
+        ret->type = SEARCH;
+        ret->text = read_line();
+        return ret;
+    }
+    arg1 = args[0];
+    arg2 = args[1];
+    // '\n', unless the line (or the input) is already over
+    end = c == '\n' || c == EOF ? c : next_char();
     switch (c) {
         case 'q':
             ret->type = QUIT;
@@ -360,44 +4140,186 @@ cmd* parse_cmd() {
             ret->args[1] = arg2;
             break;
         case 'p':
-            ret->type = PRINT;
+            // v,ind1,ind2p prints at version v
+            ret->type = a == 2 ? PRINT_AT : PRINT;
             ret->args[0] = arg1;
             ret->args[1] = arg2;
+            ret->args[2] = args[2];
             break;
         case 'd':
             ret->type = DELETE;
             ret->args[0] = arg1;
             ret->args[1] = arg2;
             break;
-        default:
-            puts("\nInvalid command format.\n");
-            putc(c, stdout);
+        case 'i':
+            ret->type = INSERT;
+            ret->args[0] = arg1;
+            ret->args[1] = arg2;
+            break;
+        case 'm':
+        case 't':
+            // ind1,ind2,destm moves (t copies) the lines after line dest
+            ret->type = c == 'm' ? MOVE : COPY;
+            ret->args[0] = arg1;
+            ret->args[1] = arg2;
+            ret->args[2] = args[2];
+            break;
+        case 'b':
+            ret->type = BRANCHES;
+            break;
+        case 'j':
+            ret->type = JUMP;
+            ret->args[0] = arg1;
+            break;
+        case 'h':
+            ret->type = DIGEST;
+            break;
+        case 'x':
+            ret->type = DIFF;
+            ret->args[0] = arg1;
+            ret->args[1] = arg2;
+            break;
+        case '{':
+            ret->type = BEGIN;
+            break;
+        case '}':
+            ret->type = COMMIT;
+            break;
+        case EOF:
+            // input over without q: quit all the same
+            ret->type = QUIT;
             break;
+        default: {
+            static const char invalid[] = "\nInvalid command format.\n\n";
+            char bad = (char) c;
+            emit(invalid, sizeof(invalid) - 1);
+            emit(&bad, 1);
+            while(end != '\n' && end != EOF) end = next_char();
+            // a session sending garbage is closed, stdin goes on with the next line
+            ret->type = session != NULL ? QUIT : INVALID;
+            break;
+        }
     }
+    if(journal != NULL) journal_command(journal, ret);
     return ret;
 }
 
-int main() {
+/**
+ * Records a command into the open batch, if it is an edit: a change or an insert reads its lines now, all of them
+ * are applied by the commit. { opens a batch (inside one it is ignored), a } without a batch is ignored.
+ * @param batch (not null)
+ * @param command (not null)
+ * @return true if the command was taken by the batch, false if it runs as usual (a commit runs on an open batch)
+ */
+bool batch_record(batch_t *batch, cmd *command) {
+    enum cmd_type type = command->type;
+    if(type == BEGIN) {
+        if(!batch->open) *batch = (batch_t) {true, 0, 0, NULL, search_index.next_id};
+        return true;
+    }
+    if(!batch->open) return type == COMMIT;
+    if(type != CHANGE && type != DELETE && type != INSERT && type != MOVE && type != COPY) return false;
+    if(batch->size >= batch->capacity) {
+        batch->capacity = batch->capacity == 0 ? INIT_BATCH_LEN : 2 * batch->capacity;
+        batch->edits = (edit_t *) realloc(batch->edits, batch->capacity * sizeof(edit_t));
+    }
+    edit_t *op = &batch->edits[batch->size++];
+    *op = (edit_t) {type, {command->args[0], command->args[1], command->args[2]}, NULL};
+    if(type == CHANGE || type == INSERT) op->content_lines = read_content(op->args[1] - op->args[0] + 1);
+    return true;
+}
+
+/**
+ * Frees a batch left open at the end of the input, with the lines it read.
+ * @param batch (not null)
+ */
+void batch_free(batch_t *batch) {
+    for(int i = 0; i < batch->size; i++) {
+        edit_t *op = &batch->edits[i];
+        for(int j = 0; op->content_lines != NULL && j <= op->args[1] - op->args[0]; j++) free_line(&op->content_lines[j]);
+        free(op->content_lines);
+    }
+    free(batch->edits);
+    *batch = (batch_t) {false, 0, 0, NULL, 0};
+}
+
+/**
+ * Frees the whole history of the linear engine, with the lines of every change.
+ * @param snap_region the region of the snapshots (not null)
+ * @param snap_capacity
+ * @param commandWrap (not null)
+ * @param editor (not null)
+ * @param reclaim (not null)
+ */
+void free_history(region_t *snap_region, int snap_capacity, command_wrap_t *commandWrap, snapshot_t *editor, reclaim_t *reclaim) {
+    snapshot_t **snapshots = (snapshot_t **) snap_region->base;
+    for(int i = 0; i < commandWrap->capacity; i++) {
+        retire_command(reclaim, commandWrap->commands[i]);
+        free(commandWrap->commands[i]);
+    }
+    for(int i = 0; i < snap_capacity; i++) {
+        retire_snapshot(reclaim, snapshots[i]);
+        free(snapshots[i]);
+    }
+    for(int i = 0; i < reclaim->size; i++) {
+        command_t *dead = &reclaim->graveyard[i];
+        for(int j = 0; j <= dead->arg2 - dead->arg1; j++) free_line(&dead->content_lines[j]);
+        free(dead->content_lines);
+    }
+    release_chunks(editor, 0);
+    free(editor->chunks);
+    free(editor->hashes);
+    free(editor);
+    region_free(snap_region);
+    free(reclaim->graveyard);
+    region_free(&commandWrap->command_region);
+    region_free(&commandWrap->node_region);
+    free(commandWrap);
+}
+
+/**
+ * Runs the editor until q, reading through next_char and writing through emit.
+ * @param tree the history in tree mode, NULL for the linear engine
+ * @param threads the most threads a replay can use
+ * @param model the cost model settings
+ * @param init_len the initial number of snapshots, changes and index nodes
+ * @param cleanup free the linear history at the end
+ */
+void edit(undo_tree_t *tree, int threads, cost_model_t model, int init_len, bool cleanup) {
     // how do i know its size? AH YES! indexes array
-    snapshot_t **snapshots = (snapshot_t**) malloc(INIT_SNAP_LEN * sizeof(snapshot_t*));
-    for(int i = 0; i < INIT_SNAP_LEN; i++) {
-        snapshots[i] = (snapshot_t *) malloc(sizeof(snapshot_t));
+    region_t snap_region = {NULL, 0, 0};
+    snapshot_t **snapshots = (snapshot_t**) region_commit(&snap_region, init_len * sizeof(snapshot_t*), true);
+    for(int i = 0; i < init_len; i++) {
+        snapshots[i] = (snapshot_t *) calloc(1, sizeof(snapshot_t));
     }
-    int snap_capacity = INIT_SNAP_LEN;
+    int snap_capacity = init_len;
     int snap_size = 0;
 
     snapshots[0]->index = 0;
     snapshots[0]->size = 0;
-    snapshots[0]->capacity = CAPACITY_CONST;
-    snapshots[0]->lines = (char **) malloc(CAPACITY_CONST * sizeof(char *));
+    snapshots[0]->capacity = 0;
+    snapshots[0]->chunks = NULL;
+    snapshots[0]->hashes = NULL;
+    snapshots[0]->digest = 0;
+    snapshots[0]->stale = 0;
 
     command_wrap_t *commandWrap = (command_wrap_t *) malloc(sizeof(command_wrap_t));
-    commandWrap->commands = (command_t**) malloc(INIT_CMD_LEN * sizeof(command_t*));
+    commandWrap->command_region = (region_t) {NULL, 0, 0};
+    commandWrap->node_region = (region_t) {NULL, 0, 0};
+    commandWrap->commands = (command_t**) region_commit(&commandWrap->command_region, init_len * sizeof(command_t*), true);
     commandWrap->size = 0;
-    commandWrap->capacity = INIT_CMD_LEN;
-    for(int i = 0; i < INIT_CMD_LEN; i++) {
-        commandWrap->commands[i] = (command_t *) malloc(sizeof(command_t));
+    commandWrap->capacity = init_len;
+    commandWrap->indexed = 0;
+    commandWrap->indexed_snap = 0;
+    commandWrap->index_end = 0;
+    for(int i = 0; i < init_len; i++) {
+        commandWrap->commands[i] = (command_t *) calloc(1, sizeof(command_t));
     }
+    // node 0 is the empty index
+    commandWrap->nodes = (index_node_t *) region_commit(&commandWrap->node_region, init_len * sizeof(index_node_t), true);
+    commandWrap->nodes[0] = (index_node_t) {0, 0, 0, 0};
+    commandWrap->node_size = 1;
+    commandWrap->node_capacity = init_len;
 
     /*int_array_t *snap_indexes = (int_array_t *) malloc(sizeof(int_array_t));
     snap_indexes->array = (int *) malloc(INIT_INDEXES_LEN * sizeof(int));
@@ -406,12 +4328,20 @@ int main() {
     snap_indexes->array[0] = 0;*/
 
     snapshot_t *editor = (snapshot_t *) malloc(sizeof(snapshot_t));
-    editor->lines = (char **) calloc(CAPACITY_CONST, sizeof(char *));
+    editor->chunks = NULL;
+    editor->hashes = NULL;
+    editor->digest = 0;
+    editor->stale = 0;
     editor->index = 0;
     editor->size = 0;
-    editor->capacity = CAPACITY_CONST;
+    editor->capacity = 0;
+
+    reclaim_t reclaim = {0, 0, 0, 0, NULL, 0};
+    batch_t batch = {false, 0, 0, NULL, 0};
+    int cold_cursor = 0;
 
     cmd* curr_cmd;
+    int budget;
     int undo_count = 0;
     int curr_snap = 0;
     int redo_count = 0;
@@ -422,66 +4352,106 @@ int main() {
     curr_cmd = parse_cmd();
     while(curr_cmd->type != QUIT) {
         tot++;
+        budget = RECLAIM_BUDGET;
+        if(batch_record(&batch, curr_cmd)) {
+            free(curr_cmd);
+            curr_cmd = parse_cmd();
+            continue;
+        }
+        if(tree != NULL) {
+            handle_tree_cmd(tree, curr_cmd, &batch);
+            if(readers != NULL) readers_collect(readers, false);
+            if(output != NULL) out_pump(output, false);
+            free(curr_cmd);
+            curr_cmd = parse_cmd();
+            continue;
+        }
         switch (curr_cmd->type) {
             case CHANGE:
                 if(undo_count > redo_count) {
                     // permanent undo
-                    handle_undo(snapshots, editor, commandWrap, undo_count, redo_count, snap_size, &command_counter, &executed_undos, &curr_snap);
-                    make_permanent(snapshots, commandWrap, curr_snap, snap_size, command_counter - curr_snap);
+                    handle_undo(snapshots, editor, commandWrap, undo_count, redo_count, snap_size, &command_counter, &executed_undos, &curr_snap, &model, threads);
+                    make_permanent(commandWrap, &reclaim, curr_snap, snap_size, command_counter - curr_snap);
                     snap_size = curr_snap;
                 } else if(redo_count > 0 && undo_count < redo_count) {
                     // permanent redo
-                    handle_redo(snapshots, editor, commandWrap, redo_count - undo_count, snap_size, &command_counter, &curr_snap);
-                    make_permanent(snapshots, commandWrap, curr_snap, snap_size, command_counter - curr_snap);
+                    handle_redo(snapshots, editor, commandWrap, redo_count - undo_count, snap_size, &command_counter, &curr_snap, &model, threads);
+                    make_permanent(commandWrap, &reclaim, curr_snap, snap_size, command_counter - curr_snap);
                     snap_size = curr_snap;
                 } else if(executed_undos > 0) {
-                    make_permanent(snapshots, commandWrap, curr_snap, snap_size, command_counter - curr_snap);
+                    make_permanent(commandWrap, &reclaim, curr_snap, snap_size, command_counter - curr_snap);
                     snap_size = curr_snap;
                 }
                 executed_undos = 0;
                 undo_count = 0;
                 redo_count = 0;
                 command_counter++;
+                retire_command(&reclaim, commandWrap->commands[commandWrap->size]);
+                budget += curr_cmd->args[1] - curr_cmd->args[0] + 1;
                 commandWrap->commands[commandWrap->size]->arg1 = curr_cmd->args[0];
                 commandWrap->commands[commandWrap->size]->arg2 = curr_cmd->args[1];
                 handle_change(editor, commandWrap->commands[commandWrap->size]);
+                commandWrap->commands[commandWrap->size]->segment = snapshots[snap_size]->index - snap_size;
+                cost_change(&model, curr_cmd->args[1] - curr_cmd->args[0] + 1);
                 commandWrap->size++;
                 // resize commandWrap if needed
                 if(commandWrap->size >= commandWrap->capacity) {
-                    commandWrap->commands = (command_t **) realloc(commandWrap->commands,
-                                                                   (commandWrap->size + INIT_CMD_LEN) * sizeof(command_t *));
-                    for(int i = commandWrap->size; i < commandWrap->size + INIT_CMD_LEN; i++) {
-                        commandWrap->commands[i] = (command_t *) malloc(sizeof(command_t));
+                    commandWrap->commands = (command_t **) region_commit(&commandWrap->command_region,
+                                                                        2 * commandWrap->capacity * sizeof(command_t *), true);
+                    for(int i = commandWrap->size; i < 2 * commandWrap->capacity; i++) {
+                        commandWrap->commands[i] = (command_t *) calloc(1, sizeof(command_t));
                     }
-                    commandWrap->capacity = commandWrap->size + INIT_CMD_LEN;
+                    commandWrap->capacity *= 2;
                 }
                 break;
             case PRINT:
+            case DIGEST:
+            case SEARCH:
                 // handle undos/redos
                 if(undo_count > redo_count) {
-                    handle_undo(snapshots, editor, commandWrap, undo_count, redo_count, snap_size, &command_counter, &executed_undos, &curr_snap);
+                    handle_undo(snapshots, editor, commandWrap, undo_count, redo_count, snap_size, &command_counter, &executed_undos, &curr_snap, &model, threads);
                 } else if(redo_count > 0 && undo_count < redo_count) {
-                    handle_redo(snapshots, editor, commandWrap, redo_count - undo_count, snap_size, &command_counter, &curr_snap);
+                    handle_redo(snapshots, editor, commandWrap, redo_count - undo_count, snap_size, &command_counter, &curr_snap, &model, threads);
                     // shift command counter
                     executed_undos -= redo_count - undo_count;
                 }
                 undo_count = 0;
                 redo_count = 0;
-                handle_print(editor, curr_cmd->args[0], curr_cmd->args[1]);
+                if(curr_cmd->type == PRINT && readers != NULL) {
+                    readers_publish(readers, editor, NULL, curr_cmd->args[0], curr_cmd->args[1]);
+                } else if(curr_cmd->type == PRINT) {
+                    handle_print(editor, curr_cmd->args[0], curr_cmd->args[1]);
+                } else if(curr_cmd->type == DIGEST) {
+                    print_digest(document_digest(editor));
+                } else {
+                    handle_search(editor, snapshots, snap_size, commandWrap, line_text(&curr_cmd->text), line_content_len(&curr_cmd->text));
+                    free_line(&curr_cmd->text);
+                }
+                break;
+            case PRINT_AT:
+                // read only: pending undos and redos stay pending
+                handle_print_at(snapshots, snap_size, commandWrap, &model, threads, curr_cmd->args[0], curr_cmd->args[1], curr_cmd->args[2]);
+                break;
+            case DIFF:
+                handle_diff(snapshots, snap_size, commandWrap, curr_cmd->args[0], curr_cmd->args[1]);
                 break;
             case DELETE:
+            case INSERT:
+            case MOVE:
+            case COPY:
+            case COMMIT:
                 if(undo_count > redo_count) {
                     // permanent undo
-                    handle_undo(snapshots, editor, commandWrap, undo_count, redo_count, snap_size, &command_counter, &executed_undos, &curr_snap);
-                    make_permanent(snapshots, commandWrap, curr_snap, snap_size, command_counter - curr_snap);
+                    handle_undo(snapshots, editor, commandWrap, undo_count, redo_count, snap_size, &command_counter, &executed_undos, &curr_snap, &model, threads);
+                    make_permanent(commandWrap, &reclaim, curr_snap, snap_size, command_counter - curr_snap);
                     snap_size = curr_snap;
                 } else if(redo_count > 0 && undo_count < redo_count) {
                     // permanent redo
-                    handle_redo(snapshots, editor, commandWrap, redo_count - undo_count, snap_size, &command_counter, &curr_snap);
-                    make_permanent(snapshots, commandWrap, curr_snap, snap_size, command_counter - curr_snap);
+                    handle_redo(snapshots, editor, commandWrap, redo_count - undo_count, snap_size, &command_counter, &curr_snap, &model, threads);
+                    make_permanent(commandWrap, &reclaim, curr_snap, snap_size, command_counter - curr_snap);
                     snap_size = curr_snap;
                 } else if(executed_undos > 0) {
-                    make_permanent(snapshots, commandWrap, curr_snap, snap_size, command_counter - curr_snap);
+                    make_permanent(commandWrap, &reclaim, curr_snap, snap_size, command_counter - curr_snap);
                     snap_size = curr_snap;
                 }
                 command_counter++;
@@ -491,10 +4461,10 @@ int main() {
                 redo_count = 0;
                 // resize snapshot structure if needed
                 if(snap_size >= snap_capacity) {
-                    snapshots = (snapshot_t **) realloc(snapshots, (snap_size + INCREASE_CONST) * sizeof(snapshot_t *));
-                    snap_capacity = snap_size + INCREASE_CONST;
+                    snapshots = (snapshot_t **) region_commit(&snap_region, 2 * snap_capacity * sizeof(snapshot_t *), true);
+                    snap_capacity *= 2;
                     for(int i = snap_size; i < snap_capacity; i++) {
-                        snapshots[i] = (snapshot_t *) malloc(sizeof(snapshot_t));
+                        snapshots[i] = (snapshot_t *) calloc(1, sizeof(snapshot_t));
                     }
                 }
                 /*snap_indexes->size++;
@@ -504,9 +4474,13 @@ int main() {
                     snap_indexes->capacity = snap_indexes->size + INCREASE_CONST;
                 }
                 snap_indexes->array[snap_indexes->size] = command_counter;*/
-                snapshots[snap_size]->index = command_counter;
                 curr_snap = snap_size;
-                handle_delete(editor, snapshots, snap_size, curr_cmd->args[0], curr_cmd->args[1]);
+                retire_snapshot(&reclaim, snapshots[snap_size]);
+                snapshots[snap_size]->index = command_counter;
+                if(curr_cmd->type == INSERT) budget += curr_cmd->args[1] - curr_cmd->args[0] + 1;
+                // a batch is a single snapshot, whatever its edits
+                if(curr_cmd->type == COMMIT) budget += search_index.next_id - batch.line_begin;
+                handle_shift(editor, snapshots, snap_size, commandWrap, &model, curr_cmd->type == COMMIT ? BATCH : curr_cmd->type, curr_cmd->args, &batch);
                 break;
             case UNDO:
                 undo_count += curr_cmd->args[0];
@@ -523,8 +4497,226 @@ int main() {
             default:
                 break;
         }
+        if(readers != NULL) {
+            readers_collect(readers, false);
+            readers_release(readers);
+        }
+        // most commands leave nothing to reclaim or to pack
+        if(reclaim.size > 0 || reclaim.cmd_end > commandWrap->size || reclaim.snap_end > snap_size) {
+            reclaim_history(&reclaim, snapshots, snap_size, commandWrap, budget);
+        }
+        if(cold_store.on && cold_store.raw > COLD_RAW_MAX) cool_history(&cold_cursor, commandWrap, COLD_BUDGET);
+        // hand what is ready to the consumer, without waiting for it
+        if(output != NULL) out_pump(output, false);
         free(curr_cmd);
         curr_cmd = NULL;
         curr_cmd = parse_cmd();
     }
+    if(model.stats) {
+        fprintf(stderr, "cost model: %lld full snapshots, %lld deltas, %lld rebuilt; averages: %.1f lines, %.1f lines per change,"
+                        " %.1f changes and %.2f restores per delete, restore depth %.1f\n",
+                model.full, model.deltas, model.rebuilt, (double) model.doc_size / FIXED_ONE,
+                (double) model.change_width / FIXED_ONE, (double) model.segment_changes / FIXED_ONE,
+                (double) model.restore_rate / FIXED_ONE, (double) model.undo_depth / FIXED_ONE);
+        fprintf(stderr, "cold history: %lld changes packed, %lld bytes of text in %lld, %lld unpacked, %lld packed at the end\n",
+                cold_store.packs, cold_store.raw_bytes, cold_store.packed_bytes, cold_store.thaws, cold_store.live);
+    }
+    free(curr_cmd);
+    batch_free(&batch);
+    if(readers != NULL) {
+        readers_collect(readers, true);
+        readers_release(readers);
+    }
+    if(cleanup) free_history(&snap_region, snap_capacity, commandWrap, editor, &reclaim);
+}
+
+/**
+ * Runs in the coroutine of a session: the editor, then the last flush.
+ */
+void session_main() {
+    session_t *current = session;
+    edit(NULL, 1, *current->model, SESSION_INIT_LEN, true);
+    out_close(current->out);
+    current->out = NULL;
+    current->done = true;
+}
+
+/**
+ * Creates the output and the coroutine of a session.
+ * @param current (not null)
+ * @return false if there is no memory left for them
+ */
+bool session_start(session_t *current) {
+    current->out = out_open(current->fd, SESSION_OUT_BUFFERS, SESSION_OUT_BLOCK, false, false);
+    current->stack = out_map(SESSION_STACK);
+    if(current->out == NULL || current->stack == NULL) return false;
+    // guard page at the bottom of the stack
+    mprotect(current->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+    getcontext(&current->context);
+    current->context.uc_stack.ss_sp = current->stack;
+    current->context.uc_stack.ss_size = SESSION_STACK;
+    current->context.uc_link = &loop_context;
+    makecontext(&current->context, session_main, 0);
+    return true;
+}
+
+void session_free(session_t *current) {
+    close(current->fd);
+    if(current->out != NULL) out_close(current->out);
+    if(current->stack != NULL) munmap(current->stack, SESSION_STACK);
+    free(current);
+}
+
+/**
+ * Handles the epoll events of a session: new input or room for output resume its coroutine,
+ * room for output while it waits for input only flushes what it printed.
+ * @param epoll
+ * @param current (not null)
+ * @param events
+ */
+void session_event(int epoll, session_t *current, unsigned int events) {
+    struct epoll_event event;
+    bool ready = (events & (EPOLLERR | EPOLLHUP)) != 0 || (events & current->waiting) != 0;
+    if(ready && current->waiting == EPOLLIN) {
+        ssize_t n = read(current->fd, current->in, SESSION_INPUT);
+        if(n > 0) {
+            current->in_pos = 0;
+            current->in_len = (int) n;
+        } else if(n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            current->eof = true;
+        } else {
+            ready = false;
+        }
+    }
+    if(ready && current->stack == NULL && (current->eof || !session_start(current))) {
+        // closed before the first command, or no memory left
+        session_free(current);
+        return;
+    }
+    if(ready) {
+        session = current;
+        output = current->out;
+        swapcontext(&loop_context, &current->context);
+        session = NULL;
+        output = NULL;
+    } else if(current->out != NULL && (events & EPOLLOUT) != 0) {
+        out_pump(current->out, false);
+    }
+    if(current->done) {
+        epoll_ctl(epoll, EPOLL_CTL_DEL, current->fd, NULL);
+        session_free(current);
+        return;
+    }
+    event.events = current->waiting;
+    if(current->out != NULL && out_pending(current->out)) event.events |= EPOLLOUT;
+    event.data.ptr = current;
+    epoll_ctl(epoll, EPOLL_CTL_MOD, current->fd, &event);
+}
+
+/**
+ * Serves editing sessions on a Unix domain socket, one document per connection, all on this thread.
+ * Every session runs the linear engine in its own coroutine, suspended whenever it needs input
+ * or its output is full.
+ * @param path the socket (replaced if it exists)
+ * @param model the cost model settings of the sessions (not null)
+ * @return 1 if the socket cannot be opened, it never returns otherwise
+ */
+int serve(const char *path, const cost_model_t *model) {
+    struct sockaddr_un address;
+    struct epoll_event event, events[MAX_EVENTS];
+    struct rlimit limit;
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int epoll = epoll_create1(0);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    unlink(path);
+    if(listener < 0 || epoll < 0 || strlen(path) >= sizeof(address.sun_path)
+       || bind(listener, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0) {
+        perror(path);
+        return 1;
+    }
+    // a connection per session: take every fd allowed, and survive clients that leave
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event);
+    while(true) {
+        int count = epoll_wait(epoll, events, MAX_EVENTS, -1);
+        for(int i = 0; i < count; i++) {
+            int fd;
+            if(events[i].data.ptr != NULL) {
+                session_event(epoll, (session_t *) events[i].data.ptr, events[i].events);
+                continue;
+            }
+            while((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                session_t *current = (session_t *) calloc(1, sizeof(session_t));
+                current->fd = fd;
+                current->waiting = EPOLLIN;
+                current->model = model;
+                event.events = EPOLLIN;
+                event.data.ptr = current;
+                epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    bool tree = false;
+    char *serve_path = NULL;
+    int threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int out_buffers = 0, reader_count = 0, sync_every = JOURNAL_SYNC_EVERY;
+    long long sync_millis = JOURNAL_SYNC_MILLIS;
+    char *journal_path = NULL;
+    bool out_splice = false, out_stats = false;
+    cost_model_t model = {true, false, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--tree") == 0) tree = true;
+        else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--out-ring") == 0 && i + 1 < argc) out_buffers = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--splice") == 0) out_splice = true;
+        else if(strcmp(argv[i], "--out-stats") == 0) out_stats = true;
+        else if(strcmp(argv[i], "--snapshots") == 0 && i + 1 < argc) model.adaptive = strcmp(argv[++i], "always") != 0;
+        else if(strcmp(argv[i], "--cost-stats") == 0) model.stats = true;
+        else if(strcmp(argv[i], "--serve") == 0 && i + 1 < argc) serve_path = argv[++i];
+        else if(strcmp(argv[i], "--huge-pages") == 0) huge_pages = true;
+        else if(strcmp(argv[i], "--print-cache") == 0) print_cache_on = true;
+        else if(strcmp(argv[i], "--cold-pack") == 0) cold_store.on = true;
+        else if(strcmp(argv[i], "--readers") == 0 && i + 1 < argc) reader_count = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--journal") == 0 && i + 1 < argc) journal_path = argv[++i];
+        else if(strcmp(argv[i], "--journal-sync") == 0 && i + 1 < argc) sync_every = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--journal-ms") == 0 && i + 1 < argc) sync_millis = atoll(argv[++i]);
+    }
+    if(serve_path != NULL) {
+        model.stats = false;
+        return serve(serve_path, &model);
+    }
+    output = NULL;
+    if(out_buffers > 0 || out_splice) {
+        fflush(stdout);
+        output = out_open(1, out_buffers, OUT_BLOCK, out_splice, out_stats);
+    }
+    if(journal_path != NULL && (journal = journal_open(journal_path, sync_every, sync_millis)) == NULL) return 1;
+    if(reader_count > 0) readers = readers_start(reader_count > MAX_READERS ? MAX_READERS : reader_count);
+    edit(tree ? new_undo_tree() : NULL, threads, model, INIT_SNAP_LEN, false);
+    if(readers != NULL) {
+        readers_stop(readers);
+        readers = NULL;
+    }
+    if(journal != NULL) {
+        journal_close(journal);
+        journal = NULL;
+    }
+    if(output != NULL) {
+        out_close(output);
+        output = NULL;
+    }
+    return 0;
 }
+
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define OUTPUT_LEN 4096
+#define WAIT_MILLIS 5000
+#define CONNECT_TRIES 200
+
+/**
+ * The editor command line, with room for the flags of a test.
+ */
+char *editor[8];
+
+/**
+ * Runs the editor on an input through a pipe, with extra flags.
+ * @param input (not null)
+ * @param flag the first extra flag, NULL for none
+ * @param value its value, NULL for none
+ * @param output the output, null terminated (not null, OUTPUT_LEN bytes)
+ * @return the exit status, -1 if the editor was killed by a signal
+ */
+int run_editor(const char *input, char *flag, char *value, char *output) {
+    int in[2], out[2], status, len = 0;
+    char *argv[8];
+    int argc = 0;
+    for(; editor[argc] != NULL; argc++) argv[argc] = editor[argc];
+    if(flag != NULL) argv[argc++] = flag;
+    if(value != NULL) argv[argc++] = value;
+    argv[argc] = NULL;
+    if(pipe(in) != 0 || pipe(out) != 0) return -1;
+    pid_t pid = fork();
+    if(pid == 0) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        close(in[1]);
+        close(out[0]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if(write(in[1], input, strlen(input)) < 0) perror("write");
+    close(in[1]);
+    for(ssize_t n; len < OUTPUT_LEN - 1 && (n = read(out[0], output + len, OUTPUT_LEN - 1 - len)) > 0;) len += (int) n;
+    output[len] = 0;
+    close(out[0]);
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * Reads a connection until its output ends with expected, or the server closes it.
+ * @param fd
+ * @param expected the end of the output to wait for, NULL to wait for the close
+ * @param output what was read, null terminated (not null, OUTPUT_LEN bytes)
+ * @return true if the output ends with expected, or the connection was closed when expected is NULL
+ */
+bool read_until(int fd, const char *expected, char *output) {
+    int len = 0;
+    struct pollfd wait = {fd, POLLIN, 0};
+    output[0] = 0;
+    while(len < OUTPUT_LEN - 1 && poll(&wait, 1, WAIT_MILLIS) > 0) {
+        ssize_t n = read(fd, output + len, OUTPUT_LEN - 1 - len);
+        if(n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        if(n <= 0) return expected == NULL;
+        len += (int) n;
+        output[len] = 0;
+        if(expected != NULL && len >= (int) strlen(expected) && strcmp(output + len - strlen(expected), expected) == 0) return true;
+    }
+    return false;
+}
+
+/**
+ * @param path the socket of the server (not null)
+ * @return a connection, -1 if the server does not accept one
+ */
+int connect_server(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    for(int i = 0; i < CONNECT_TRIES; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0) return fd;
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+bool send_text(int fd, const char *text) {
+    return write(fd, text, strlen(text)) == (ssize_t) strlen(text);
+}
+
+/**
+ * A garbage line is reported and skipped, the end of the input quits and flushes the output.
+ * @return the number of failed checks
+ */
+int test_stdin() {
+    char output[OUTPUT_LEN];
+    int failed = 0;
+    int status = run_editor("zz\n1,1c\nkept\n.\n\n1,1p\n", NULL, NULL, output);
+    if(status != 0 || strstr(output, "Invalid command format.") == NULL || strcmp(output + strlen(output) - 5, "kept\n") != 0) {
+        printf("stdin: garbage then end of input without q: status %d, output \"%s\"\n", status, output);
+        failed++;
+    }
+    return failed;
+}
+
+/**
+ * Neither garbage nor the end of the input is journaled: recovery replays the change alone.
+ * @return the number of failed checks
+ */
+int test_journal() {
+    char output[OUTPUT_LEN], path[] = "/tmp/edu_invalid_XXXXXX";
+    int failed = 0;
+    int fd = mkstemp(path);
+    close(fd);
+    unlink(path);
+    int status = run_editor("1,1c\nkept\n.\nzz\n", "--journal", path, output);
+    if(status != 0) {
+        printf("journal: recording run failed with status %d\n", status);
+        failed++;
+    }
+    status = run_editor("1,2p\nq\n", "--journal", path, output);
+    if(status != 0 || strcmp(output, "kept\n.\n") != 0) {
+        printf("journal: recovery run: status %d, output \"%s\"\n", status, output);
+        failed++;
+    }
+    unlink(path);
+    return failed;
+}
+
+/**
+ * A session sending a garbage line is closed, the other sessions and the server go on.
+ * @return the number of failed checks
+ */
+int test_serve() {
+    char output[OUTPUT_LEN], path[] = "/tmp/edu_serve_XXXXXX";
+    char *argv[8];
+    int argc = 0, failed = 0;
+    int fd = mkstemp(path);
+    close(fd);
+    for(; editor[argc] != NULL; argc++) argv[argc] = editor[argc];
+    argv[argc++] = "--serve";
+    argv[argc++] = path;
+    argv[argc] = NULL;
+    pid_t pid = fork();
+    if(pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    // mkstemp made a plain file: wait for the server to replace it with its socket
+    int first = -1;
+    for(int i = 0; i < CONNECT_TRIES && first < 0; i++) {
+        first = connect_server(path);
+        if(first < 0) usleep(10000);
+    }
+    int bad = connect_server(path), last = connect_server(path);
+    if(first < 0 || bad < 0 || last < 0) {
+        printf("serve: cannot connect to %s\n", path);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+    if(!send_text(first, "1,1c\nfirst\n.\n") || !send_text(bad, "1,1c\nbad\n.\nzz\n1,1p\n")
+       || !read_until(bad, NULL, output) || strstr(output, "bad") != NULL) {
+        printf("serve: the session sending garbage was not closed before running more commands: \"%s\"\n", output);
+        failed++;
+    }
+    if(!send_text(first, "1,1p\n") || !read_until(first, "first\n", output)) {
+        printf("serve: another session stopped working: \"%s\"\n", output);
+        failed++;
+    }
+    if(!send_text(last, "1,1c\nlast\n.\n1,1p\nq\n") || !read_until(last, "last\n", output)) {
+        printf("serve: a later session stopped working: \"%s\"\n", output);
+        failed++;
+    }
+    if(waitpid(pid, NULL, WNOHANG) != 0) {
+        printf("serve: the server exited\n");
+        failed++;
+    }
+    close(first);
+    close(bad);
+    close(last);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(path);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc < 2 || argc > 5) {
+        fputs("usage: edu_invalid_input editor [editor args...]\n"
+              "Checks that garbage lines and the end of the input without q are handled on stdin, in the journal\n"
+              "and by the session server, where only the session sending garbage is closed.\n", stderr);
+        return 2;
+    }
+    for(int i = 1; i < argc; i++) editor[i - 1] = argv[i];
+    editor[argc - 1] = NULL;
+    signal(SIGPIPE, SIG_IGN);
+    int failed = test_stdin() + test_journal() + test_serve();
+    printf("%d checks failed\n", failed);
+    return failed > 0 ? 1 : 0;
+}